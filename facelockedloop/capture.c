@@ -4,13 +4,42 @@
  * 
  * @author Raquel Medina <raquel.medina.rodriguez@gmail.com>
  *
+ * Frames come from a camera, a video file or a directory of images; the
+ * last two are either replayed as fast as possible or paced on their
+ * recorded timestamps. A synthetic scene - one face, looked at through
+ * the servos fll-servosim simulates - closes the tracking loop without
+ * any hardware. A V4L2 device node is read directly, its YUYV or GREY
+ * buffers going downstream as they are.
  */
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include "kernel_utils.h"
+#include "time_utils.h"
+#include "servosim.h"
 #include "capture.h"
 
+#include "imgproc/imgproc_c.h"
+
+/* synthetic scene: camera, and where the face is in servo angles */
+#define SIM_WIDTH		640
+#define SIM_HEIGHT		480
+#define SIM_HFOV		60.0
+#define SIM_FACE_WIDTH		140
+#define SIM_FACE_PAN		15.0
+#define SIM_FACE_TILT		10.0
+/* closer than this to the centre the tracker leaves the servos alone */
+#define SIM_CONVERGED_X		50
+#define SIM_CONVERGED_Y		30
+
+static const char *capture_exts[] = {
+	".png", ".jpg", ".jpeg", ".bmp", ".pgm", ".ppm", ".tif", ".tiff",
+};
+
 static
 void capture_stage_up(struct stage *stg, struct stage_params *p,
 			     struct stage_ops *o,struct pipeline *pipe)
@@ -19,11 +48,171 @@ void capture_stage_up(struct stage *stg, struct stage_params *p,
 	pipeline_register(pipe, stg);
 }
 
+static
+unsigned long long capture_sim_commands(const struct servosim_state *st)
+{
+	unsigned long long n = 0;
+	int c;
+
+	for (c = 0; c < SERVOIO_CHANNELS; c++)
+		n += st->axis[c].commands;
+
+	return n;
+}
+
+static
+void capture_sim_report(struct imager *i)
+{
+	struct servosim_state st;
+	double secs;
+
+	if (servosim_read(i->sim, &st))
+		return;
+
+	secs = (double) (monotonic_nsecs() - i->sim_start) /
+		FLL_NANOSECONDS_IN_SECOND;
+	printf("sim: %.1f servo commands/s", secs > 0 ?
+	       (capture_sim_commands(&st) - i->sim_commands) / secs : 0);
+
+	if (i->sim_converged)
+		printf(", converged after %.3f s.\n",
+		       (double) (i->sim_converged - i->sim_start) /
+		       FLL_NANOSECONDS_IN_SECOND);
+	else
+		printf(", never converged.\n");
+}
+
+/* paste the face where the current servo angles make it appear */
+static
+IplImage *capture_grab_sim(struct imager *i)
+{
+	struct servosim_state st;
+	int cx, cy, x0, y0, x1, y1, fx, fy;
+	double pan, tilt, k;
+
+	if (servosim_read(i->sim, &st))
+		return NULL;
+
+	if (!i->still) {
+		i->still = cvCreateImage(cvSize(SIM_WIDTH, SIM_HEIGHT),
+					 IPL_DEPTH_8U, 3);
+		if (!i->still)
+			return NULL;
+	}
+
+	pan = servosim_angle(&st.axis[pan_channel]);
+	tilt = servosim_angle(&st.axis[tilt_channel]);
+	k = SIM_WIDTH / SIM_HFOV;
+	/* the directions the tracker drives the servos in */
+	cx = SIM_WIDTH / 2 + k * (pan - SIM_FACE_PAN);
+	cy = SIM_HEIGHT / 2 + k * (SIM_FACE_TILT - tilt);
+
+	cvSet(i->still, CV_RGB(96, 96, 96), NULL);
+
+	x0 = cx - i->face->width / 2;
+	y0 = cy - i->face->height / 2;
+	x1 = x0 + i->face->width < SIM_WIDTH ? x0 + i->face->width : SIM_WIDTH;
+	y1 = y0 + i->face->height < SIM_HEIGHT ? y0 + i->face->height : SIM_HEIGHT;
+	fx = x0 < 0 ? -x0 : 0;
+	fy = y0 < 0 ? -y0 : 0;
+	x0 += fx;
+	y0 += fy;
+
+	if (x1 > x0 && y1 > y0) {
+		cvSetImageROI(i->face, cvRect(fx, fy, x1 - x0, y1 - y0));
+		cvSetImageROI(i->still, cvRect(x0, y0, x1 - x0, y1 - y0));
+		cvCopy(i->face, i->still, NULL);
+		cvResetImageROI(i->still);
+		cvResetImageROI(i->face);
+	}
+
+	if (!i->sim_start) {
+		i->sim_start = monotonic_nsecs();
+		i->sim_commands = capture_sim_commands(&st);
+	}
+
+	if (!i->sim_converged && abs(cx - SIM_WIDTH / 2) < SIM_CONVERGED_X &&
+	    abs(cy - SIM_HEIGHT / 2) < SIM_CONVERGED_Y)
+		i->sim_converged = monotonic_nsecs();
+
+	return i->still;
+}
+
+static
+int capture_open_sim(struct imager *i)
+{
+	const char *path = i->params.source + strlen(CAPTURE_SIM_PREFIX);
+	IplImage *face;
+	int height;
+
+	i->sim = servosim_map(0);
+	if (!i->sim) {
+		printf("capture: no servo simulator running.\n");
+		return -ENODEV;
+	}
+
+	face = cvLoadImage(path, CV_LOAD_IMAGE_COLOR);
+	if (!face)
+		return -ENOENT;
+
+	height = face->height * SIM_FACE_WIDTH / face->width;
+	i->face = cvCreateImage(cvSize(SIM_FACE_WIDTH, height), IPL_DEPTH_8U, 3);
+	if (i->face)
+		cvResize(face, i->face, CV_INTER_AREA);
+	cvReleaseImage(&face);
+	if (!i->face)
+		return -ENOMEM;
+
+	/* the servos move in real time, so must the scene */
+	i->params.pacing = CAPTURE_REALTIME;
+	i->period_msec = (double) FLL_MILISECONDS_IN_SECOND / i->params.fps;
+
+	return 0;
+}
+
 static
 void capture_teardown(struct imager *i)
 {
-	cvDestroyWindow(i->params.name);
-	cvReleaseCapture(&i->params.videocam);
+	int n;
+
+	if (i->kind != CAPTURE_CAMERA)
+		printf("capture: %d frames from %s, %lu skipped.\n",
+		       i->params.frameidx, i->params.source, i->skipped);
+
+	if (i->starved)
+		printf("capture: %lu frames dropped, no free buffer.\n",
+		       i->starved);
+
+	if (i->kind == CAPTURE_SIM)
+		capture_sim_report(i);
+	if (i->sim)
+		servosim_unmap(i->sim);
+	if (i->face)
+		cvReleaseImage(&i->face);
+
+	if (i->pacing.count) {
+		printf("capture: pacing timer lateness\n");
+		hist_print(&i->pacing, "pacing");
+	}
+
+	if (i->kind == CAPTURE_V4L2) {
+		printf("capture: %lu frames lost by the driver.\n", i->cam.lost);
+		hist_print(&i->delivery, "delivery");
+		v4l2cam_close(&i->cam);
+	}
+
+	if (i->params.videocam)
+		cvReleaseCapture(&i->params.videocam);
+	if (i->still)
+		cvReleaseImage(&i->still);
+
+	for (n = 0; n < i->nfiles; n++)
+		free(i->files[n]);
+	free(i->files);
+	i->files = NULL;
+	i->nfiles = 0;
+
+	frame_pool_destroy(&i->pool);
 }
 
 static
@@ -31,31 +220,233 @@ void capture_stage_down(struct stage *stg)
 {
 	struct imager *imgr = container_of(stg, struct imager, step);
 
-	capture_teardown(imgr);
 	stage_down(stg);
+	capture_teardown(imgr);
 	pipeline_deregister(stg->pipeline, stg);
 }
 
+static
+int capture_image_filter(const struct dirent *d)
+{
+	const char *ext = strrchr(d->d_name, '.');
+	unsigned int n;
+
+	if (!ext)
+		return 0;
+
+	for (n = 0; n < sizeof(capture_exts) / sizeof(capture_exts[0]); n++) {
+		if (!strcasecmp(ext, capture_exts[n]))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* the next image of the sequence, stamped at the nominal frame rate */
+static
+IplImage *capture_grab_still(struct imager *i, double *msec)
+{
+	char path[PATH_MAX];
+
+	if (i->still)
+		cvReleaseImage(&i->still);
+
+	while (i->nextfile < i->nfiles) {
+		snprintf(path, sizeof(path), "%s/%s", i->params.source,
+			 i->files[i->nextfile]->d_name);
+		*msec = i->nextfile * i->period_msec;
+		i->nextfile++;
+
+		i->still = cvLoadImage(path, CV_LOAD_IMAGE_COLOR);
+		if (i->still)
+			return i->still;
+
+		printf("capture: can't load %s, skipped.\n", path);
+	}
+
+	return NULL;
+}
+
+static
+IplImage *capture_grab(struct imager *i, double *msec)
+{
+	if (i->kind == CAPTURE_DIR)
+		return capture_grab_still(i, msec);
+
+	if (!cvGrabFrame(i->params.videocam))
+		return NULL;
+
+	*msec = cvGetCaptureProperty(i->params.videocam, CV_CAP_PROP_POS_MSEC);
+	/* some backends have no timestamps: assume the nominal rate */
+	if (i->kind == CAPTURE_FILE && *msec <= 0)
+		*msec = (i->params.frameidx + i->skipped) * i->period_msec;
+
+	return cvRetrieveFrame(i->params.videocam, 0);
+}
+
+/*
+ * how late a recorded frame is against the wall clock, once the first
+ * one has set the origin; early frames are waited for.
+ */
+static
+double capture_pace(struct imager *i, double msec)
+{
+	struct timespec now, due, delta;
+	double offset, elapsed;
+
+	if (!i->params.frameidx && !i->skipped) {
+		clock_gettime(CLOCK_MONOTONIC, &i->base);
+		i->base_msec = msec;
+		return 0;
+	}
+
+	offset = msec - i->base_msec;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - i->base.tv_sec) * FLL_MILISECONDS_IN_SECOND +
+		(double) (now.tv_nsec - i->base.tv_nsec) /
+		FLL_NANOSECONDS_IN_MILISECOND;
+
+	if (elapsed >= offset)
+		return elapsed - offset;
+
+	delta.tv_sec = offset / FLL_MILISECONDS_IN_SECOND;
+	delta.tv_nsec = (offset - delta.tv_sec * FLL_MILISECONDS_IN_SECOND) *
+		FLL_NANOSECONDS_IN_MILISECOND;
+	due = i->base;
+	timespec_add(&due, &delta);
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+
+	/* how late the timer let us go */
+	hist_record(&i->pacing, monotonic_nsecs() -
+		    ((unsigned long long) due.tv_sec * FLL_NANOSECONDS_IN_SECOND +
+		     due.tv_nsec));
+
+	return 0;
+}
+
+/* the driver buffer itself becomes the frame */
+static
+int capture_run_v4l2(struct imager *i)
+{
+	unsigned long long birth, stamp;
+	struct frame *f;
+	int index, ret;
+
+	ret = v4l2cam_dequeue(&i->cam, &index, &stamp);
+	if (ret)
+		return ret;
+
+	birth = monotonic_nsecs();
+	if (stamp && stamp <= birth)
+		hist_record(&i->delivery, birth - stamp);
+	else
+		stamp = birth;
+
+	f = frame_get(&i->pool);
+	if (!f) {
+		/* downstream still holds every frame: give it back unseen */
+		v4l2cam_queue(&i->cam, index);
+		i->starved++;
+		return 0;
+	}
+
+	frame_attach(f, i->cam.maps[index].start, i->cam.bytesperline, index);
+	f->birth = birth;
+	f->exposure = stamp;
+	i->step.params.birth = birth;
+	i->params.frame = f;
+	i->params.frameidx++;
+
+	return 0;
+}
+
+static
+void capture_v4l2_release(struct frame *f)
+{
+	struct imager *i = f->pool->owner;
+
+	if (i->cam.streaming)
+		v4l2cam_queue(&i->cam, f->buffer);
+}
+
 static
 int capture_run(struct imager *i)
 {
 	IplImage *srcframe;
+	unsigned long long birth;
+	struct frame *f;
+	double msec = 0;
 
-	if (i->params.vididx < 0)
+	i->params.frame = NULL;
+	i->step.params.birth = 0;
+
+	if (i->kind == CAPTURE_CAMERA && i->params.vididx < 0)
 		return -EINVAL;
 
-	if (!(i->params.videocam))
+	if ((i->kind == CAPTURE_CAMERA || i->kind == CAPTURE_FILE) &&
+	    !(i->params.videocam))
 		return -ENODEV;
 
-	if (cvGrabFrame(i->params.videocam)) {
-		srcframe = cvRetrieveFrame(i->params.videocam, 0);
-		if (!srcframe)
-			return -EIO;
+	if (i->eos)
+		return -ENODATA;
+
+	if (i->kind == CAPTURE_V4L2)
+		return capture_run_v4l2(i);
+
+	for (;;) {
+		if (i->kind == CAPTURE_SIM) {
+			/* rendered when due: the servos move meanwhile */
+			capture_pace(i, i->params.frameidx * i->period_msec);
+			srcframe = capture_grab_sim(i);
+			if (!srcframe)
+				return -EIO;
+			break;
+		}
+
+		srcframe = capture_grab(i, &msec);
+		if (!srcframe) {
+			if (i->kind == CAPTURE_CAMERA)
+				return -EAGAIN;
+
+			/* end of the recording: stop the pipeline */
+			i->eos = 1;
+			pipeline_terminate(i->step.pipeline, -ENODATA);
+			return -ENODATA;
+		}
+
+		if (i->kind == CAPTURE_CAMERA || i->params.pacing == CAPTURE_FAST)
+			break;
+
+		/* a camera would have overwritten a frame this late */
+		if (capture_pace(i, msec) <= i->period_msec)
+			break;
+
+		i->skipped++;
+	}
+
+	/* the frame is as old as the moment it was handed to us */
+	birth = monotonic_nsecs();
 
-		i->params.frame = srcframe;
-		cvWaitKey(10);
+	/* downstream still holds every buffer: skip this frame */
+	f = frame_get(&i->pool);
+	if (!f) {
+		i->starved++;
+		return 0;
 	}
 
+	f->birth = birth;
+	f->exposure = birth;
+	i->step.params.birth = birth;
+
+	/* OpenCV reuses srcframe on the next grab */
+	if (srcframe->width == f->image->width &&
+	    srcframe->height == f->image->height)
+		cvCopy(srcframe, f->image, NULL);
+	else
+		cvResize(srcframe, f->image, CV_INTER_LINEAR);
+	i->params.frame = f;
+	i->params.frameidx++;
+
 	return 0;
 }
 
@@ -80,6 +471,18 @@ int capture_stage_output(struct stage *stg, void* it)
 	return stage_output(stg, stg->params.data_out);
 }
 
+static
+void capture_stage_release(struct stage *stg, void *it)
+{
+	frame_put(it);
+}
+
+static
+void capture_stage_hold(struct stage *stg, void *it)
+{
+	frame_hold(it);
+}
+
 
 static
 struct stage_ops capture_ops = {
@@ -89,37 +492,173 @@ struct stage_ops capture_ops = {
 	.up = capture_stage_up,
 	.wait = stage_wait,
 	.go = stage_go,
+	.release = capture_stage_release,
+	.hold = capture_stage_hold,
 };
 
 
+static
+int capture_open_dir(struct imager *i)
+{
+	i->nfiles = scandir(i->params.source, &i->files, capture_image_filter,
+			    versionsort);
+	if (i->nfiles < 0) {
+		i->nfiles = 0;
+		return -errno;
+	}
+
+	if (!i->nfiles)
+		return -ENOENT;
+
+	i->period_msec = (double) FLL_MILISECONDS_IN_SECOND / i->params.fps;
+
+	return 0;
+}
+
+static
+int capture_open(struct imager *i)
+{
+	struct stat st;
+	double fps;
+
+	if (!i->params.source) {
+		i->kind = CAPTURE_CAMERA;
+		i->params.videocam =
+			cvCreateCameraCapture(CV_CAP_ANY + i->params.vididx);
+		if (!(i->params.videocam))
+			return -ENODEV;
+#if 0
+		/* this requires modifications to the servo algorithms */
+		cvSetCaptureProperty(i->params.videocam, CV_CAP_PROP_FRAME_WIDTH, 1280.0);
+		cvSetCaptureProperty(i->params.videocam, CV_CAP_PROP_FRAME_HEIGHT, 720.0);
+#endif
+		cvSetCaptureProperty(i->params.videocam, CV_CAP_PROP_FPS, 30);
+		return 0;
+	}
+
+	if (!strncmp(i->params.source, CAPTURE_SIM_PREFIX,
+		     strlen(CAPTURE_SIM_PREFIX))) {
+		i->kind = CAPTURE_SIM;
+		return capture_open_sim(i);
+	}
+
+	if (stat(i->params.source, &st))
+		return -errno;
+
+	if (S_ISDIR(st.st_mode)) {
+		i->kind = CAPTURE_DIR;
+		return capture_open_dir(i);
+	}
+
+	/* every frame in flight holds a buffer, the driver needs two more */
+	if (S_ISCHR(st.st_mode)) {
+		i->kind = CAPTURE_V4L2;
+		return v4l2cam_open(&i->cam, i->params.source,
+				    CAPTURE_V4L2_WIDTH, CAPTURE_V4L2_HEIGHT,
+				    i->params.fps, i->params.nframes + 2);
+	}
+
+	i->kind = CAPTURE_FILE;
+	i->params.videocam = cvCreateFileCapture(i->params.source);
+	if (!(i->params.videocam))
+		return -ENODEV;
+
+	/* only used to decide when a frame is too late to be shown */
+	fps = cvGetCaptureProperty(i->params.videocam, CV_CAP_PROP_FPS);
+	if (fps <= 0)
+		fps = i->params.fps;
+	i->period_msec = FLL_MILISECONDS_IN_SECOND / fps;
+
+	return 0;
+}
+
 int capture_initialize(struct imager *i, struct imager_params *p,
 		       struct pipeline *pipe)
 {
 	struct stage_params stgparams;
+	IplImage *srcframe;
+	double msec;
+	int ret;
 
 	stgparams.nth_stage = CAPTURE_STAGE;
+	stgparams.upstream = STAGE_SOURCE;
 	stgparams.data_out = NULL;
 	stgparams.data_in = NULL;
 
 	i->params.vididx = p->vididx;
 	i->params.frame = p->frame;
 	i->params.name = p->name;
+	i->params.source = p->source;
+	i->params.pacing = p->pacing;
+	i->params.fps = p->fps > 0 ? p->fps : CAPTURE_DEFAULT_FPS;
+	i->params.videocam = NULL;
 	i->params.frameidx = 0;
+	i->files = NULL;
+	i->nfiles = 0;
+	i->nextfile = 0;
+	i->still = NULL;
+	i->skipped = 0;
+	i->starved = 0;
+	hist_reset(&i->delivery);
+	hist_reset(&i->pacing);
+	i->sim = NULL;
+	i->face = NULL;
+	i->sim_start = 0;
+	i->sim_converged = 0;
+	i->cam.fd = -1;
+	i->eos = 0;
+	i->params.nframes = p->nframes;
 
-	i->params.videocam = cvCreateCameraCapture(CV_CAP_ANY + i->params.vididx);
-	if (!(i->params.videocam))
-		return -ENODEV;
+	ret = capture_open(i);
+	if (ret)
+		return ret;
 
 	p->videocam = i->params.videocam;
 
-#if 0
-	/* this requires modifications to the servo algorithms */
-	cvSetCaptureProperty(i->params.videocam, CV_CAP_PROP_FRAME_WIDTH, 1280.0);
-	cvSetCaptureProperty(i->params.videocam, CV_CAP_PROP_FRAME_HEIGHT, 720.0);
-#endif
-	cvSetCaptureProperty(i->params.videocam, CV_CAP_PROP_FPS, 30);
+	if (i->kind == CAPTURE_V4L2) {
+		ret = frame_pool_init_external(&i->pool, i->params.nframes,
+			i->cam.width, i->cam.height,
+			i->cam.format == V4L2CAM_YUYV ? 2 : 1,
+			i->cam.format == V4L2CAM_YUYV ? FRAME_YUYV : FRAME_GREY,
+			capture_v4l2_release, i);
+		if (ret)
+			return ret;
+
+		ret = v4l2cam_start(&i->cam);
+		if (ret)
+			return ret;
+
+		capture_stage_up(&i->step, &stgparams, &capture_ops, pipe);
+
+		return 0;
+	}
+
+	/* size the frame pool after what the source actually delivers */
+	if (i->kind == CAPTURE_DIR) {
+		srcframe = capture_grab_still(i, &msec);
+		/* replay from the first image */
+		i->nextfile = 0;
+	} else if (i->kind == CAPTURE_SIM) {
+		srcframe = capture_grab_sim(i);
+		/* the clock starts with the first frame delivered */
+		i->sim_start = 0;
+		i->sim_converged = 0;
+	} else {
+		srcframe = cvQueryFrame(i->params.videocam);
+		if (i->kind == CAPTURE_FILE)
+			cvSetCaptureProperty(i->params.videocam,
+					     CV_CAP_PROP_POS_FRAMES, 0);
+	}
+	if (!srcframe)
+		return -EIO;
+
+	ret = frame_pool_init(&i->pool, i->params.nframes, srcframe->width,
+			      srcframe->height, srcframe->depth,
+			      srcframe->nChannels);
+	if (ret)
+		return ret;
+
 	capture_stage_up(&i->step, &stgparams, &capture_ops, pipe);
 
 	return 0;
 }
-
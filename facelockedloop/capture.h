@@ -5,25 +5,62 @@
 extern "C" {
 #endif
 
+#include <time.h>
+#include <dirent.h>
+
 #include "pipeline.h"
+#include "frame.h"
+#include "v4l2cam.h"
+
+enum capture_source {
+	CAPTURE_CAMERA = 0,
+	CAPTURE_FILE = 1,
+	CAPTURE_DIR = 2,
+	/* a face seen through the simulated servos of fll-servosim */
+	CAPTURE_SIM = 3,
+	/* a V4L2 device, its buffers handed downstream unconverted */
+	CAPTURE_V4L2 = 4,
+};
+
+#define CAPTURE_V4L2_WIDTH	640
+#define CAPTURE_V4L2_HEIGHT	480
+
+#define CAPTURE_SIM_PREFIX	"sim:"
+
+enum capture_pacing {
+	/* as fast as the pipeline takes them */
+	CAPTURE_FAST = 0,
+	/* at the pace they were recorded, late frames are skipped */
+	CAPTURE_REALTIME = 1,
+};
+
+#define CAPTURE_DEFAULT_FPS	30
 
 #if defined(HAVE_OPENCV2)
 #include "highgui/highgui_c.h"
 
 struct imager_params {
 	char* name;
+	char *source;
+	enum capture_pacing pacing;
+	int fps;
 	int vididx;
 	int frameidx;
-	IplImage* frame;
+	int nframes;
+	struct frame *frame;
 	CvCapture* videocam;
 };
 
 #else
 struct imager_params {
-	char *name];
+	char *name;
+	char *source;
+	enum capture_pacing pacing;
+	int fps;
 	int vididx;
 	int frameidx;
-	void* frame;
+	int nframes;
+	struct frame *frame;
 	void* videocam;
 };
 
@@ -32,10 +69,37 @@ struct imager_params {
 struct imager {
 	struct stage step;
 	struct imager_params params;
+	struct frame_pool pool;
+	enum capture_source kind;
+	/* image sequence: sorted directory entries and the one loaded */
+	struct dirent **files;
+	int nfiles;
+	int nextfile;
+	IplImage *still;
+	/* realtime pacing: first frame's timestamp and when it was due */
+	struct timespec base;
+	double base_msec;
+	double period_msec;
+	unsigned long skipped;
+	/* frames dropped while downstream held every buffer */
+	unsigned long starved;
+	/* synthetic scene: servo state, face sprite and convergence */
+	struct servosim_state *sim;
+	IplImage *face;
+	unsigned long long sim_start;
+	unsigned long long sim_converged;
+	unsigned long long sim_commands;
+	struct v4l2cam cam;
+	/* driver timestamp to the buffer being dequeued */
+	struct hist delivery;
+	/* how late the pacing timer let a paced source go */
+	struct hist pacing;
+	int eos;
 	int status;
 };
 
 struct pipeline;
+struct servosim_state;
   
 int capture_initialize(struct imager *i, struct imager_params *p, struct pipeline *pipe);
 #ifdef __cplusplus
@@ -0,0 +1,257 @@
+/**
+ * @file facelockedloop/cascade.c
+ * @brief Converts an OpenCV XML Haar cascade into the binary blob the
+ * native detector maps at startup.
+ *
+ * The blob is written in host byte order; build it on (or for) the
+ * target that is going to load it.
+ *
+ * With --compare, both detectors look at the same images instead, the way
+ * fll asks them to, and every box is matched with its best overlapping
+ * counterpart: any box left without one of at least CASCADE_MATCH_IOU
+ * is reported and makes the comparison fail.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "haar.h"
+
+#include "objdetect/objdetect.hpp"
+#include "highgui/highgui_c.h"
+
+/* the detection parameters detect.c gives both detectors */
+#define CASCADE_SCALE_FACTOR	1.2
+#define CASCADE_MIN_NEIGHBORS	2
+/* intersection over union a box needs with its counterpart */
+#define CASCADE_MATCH_IOU	0.8
+#define CASCADE_MAX_BOXES	64
+
+static
+void usage(void)
+{
+	fprintf(stderr, "usage: fll-cascade <cascade.xml> <cascade.fllc>\n"
+		"       fll-cascade --compare [--canny] <cascade.xml> "
+		"<image>...\n");
+}
+
+static
+double cascade_iou(const struct haar_box *a, const struct haar_box *b)
+{
+	int w, h, inter, uni;
+
+	w = (a->x + a->width < b->x + b->width ?
+	     a->x + a->width : b->x + b->width) - (a->x > b->x ? a->x : b->x);
+	h = (a->y + a->height < b->y + b->height ?
+	     a->y + a->height : b->y + b->height) - (a->y > b->y ? a->y : b->y);
+	if (w <= 0 || h <= 0)
+		return 0;
+
+	inter = w * h;
+	uni = a->width * a->height + b->width * b->height - inter;
+
+	return (double) inter / uni;
+}
+
+/* pairs each box of a with the best free one of b, returns the unpaired */
+static
+int cascade_match(const struct haar_box *a, int na, const struct haar_box *b,
+		  int nb, const char *what, double *worst)
+{
+	int used[CASCADE_MAX_BOXES] = { 0 };
+	int i, j, best, missed = 0;
+	double iou, top;
+
+	for (i = 0; i < na; i++) {
+		for (j = 0, best = -1, top = 0; j < nb; j++) {
+			iou = cascade_iou(&a[i], &b[j]);
+			if (!used[j] && iou > top) {
+				top = iou;
+				best = j;
+			}
+		}
+
+		if (best >= 0 && top >= CASCADE_MATCH_IOU) {
+			used[best] = 1;
+			if (top < *worst)
+				*worst = top;
+			continue;
+		}
+
+		printf("    %s only: %dx%d at %d,%d (best IoU %.3f)\n", what,
+		       a[i].width, a[i].height, a[i].x, a[i].y, top);
+		missed++;
+	}
+
+	return missed;
+}
+
+static
+int cascade_compare_image(CvHaarClassifierCascade *cv, struct haar_detector *hd,
+			  CvMemStorage *storage, int flags, const char *path)
+{
+	struct haar_box cvbox[CASCADE_MAX_BOXES], native[CASCADE_MAX_BOXES];
+	struct haar_params hp = {
+		.scale_factor = CASCADE_SCALE_FACTOR,
+		.min_neighbors = CASCADE_MIN_NEIGHBORS,
+	};
+	double worst = 1;
+	int i, ncv, nnative, missed;
+	CvAvgComp *comp;
+	IplImage *img;
+	CvSeq *faces;
+
+	img = cvLoadImage(path, CV_LOAD_IMAGE_GRAYSCALE);
+	if (!img) {
+		fprintf(stderr, "error: can't load %s\n", path);
+		return -1;
+	}
+
+	cvClearMemStorage(storage);
+	faces = cvHaarDetectObjects(img, cv, storage, CASCADE_SCALE_FACTOR,
+				    CASCADE_MIN_NEIGHBORS, flags,
+				    cvSize(0, 0), cvSize(0, 0));
+	ncv = faces ? faces->total : 0;
+	if (ncv > CASCADE_MAX_BOXES)
+		ncv = CASCADE_MAX_BOXES;
+	for (i = 0; i < ncv; i++) {
+		comp = (CvAvgComp *) cvGetSeqElem(faces, i);
+		cvbox[i].x = comp->rect.x;
+		cvbox[i].y = comp->rect.y;
+		cvbox[i].width = comp->rect.width;
+		cvbox[i].height = comp->rect.height;
+		cvbox[i].neighbors = comp->neighbors;
+	}
+
+	nnative = haar_detect(hd, (unsigned char *) img->imageData, img->width,
+			      img->height, img->widthStep, &hp, native,
+			      CASCADE_MAX_BOXES);
+	cvReleaseImage(&img);
+	if (nnative < 0) {
+		fprintf(stderr, "error: native detection of %s: %s\n", path,
+			strerror(-nnative));
+		return -1;
+	}
+
+	printf("%s: opencv %d, native %d\n", path, ncv, nnative);
+	missed = cascade_match(cvbox, ncv, native, nnative, "opencv", &worst);
+	missed += cascade_match(native, nnative, cvbox, ncv, "native", &worst);
+	if (ncv || nnative)
+		printf("    %d unmatched, worst matched IoU %.3f\n", missed,
+		       worst);
+
+	return missed;
+}
+
+/*
+ * OpenCV's canny pruning skips windows with few edges, which the native
+ * detector never does: without --canny both look at the same windows.
+ */
+static
+int cascade_compare(int argc, char *const argv[])
+{
+	CvHaarClassifierCascade *cv;
+	struct haar_detector hd;
+	struct haar_cascade *c;
+	CvMemStorage *storage;
+	int flags = 0, differ = 0, failed = 0;
+	int i, ret;
+
+	if (argc > 0 && !strcmp(argv[0], "--canny")) {
+		flags = CV_HAAR_DO_CANNY_PRUNING;
+		argc--;
+		argv++;
+	}
+
+	if (argc < 2) {
+		usage();
+		return 1;
+	}
+
+	cv = (CvHaarClassifierCascade *) cvLoad(argv[0], 0, 0, 0);
+	if (!cv) {
+		fprintf(stderr, "error: can't load %s\n", argv[0]);
+		return 1;
+	}
+
+	c = haar_cascade_from_cv(cv);
+	if (!c || haar_detector_init(&hd, c)) {
+		fprintf(stderr, "error: %s can't be converted\n", argv[0]);
+		haar_cascade_free(c);
+		cvReleaseHaarClassifierCascade(&cv);
+		return 1;
+	}
+	storage = cvCreateMemStorage(0);
+
+	for (i = 1; i < argc; i++) {
+		ret = cascade_compare_image(cv, &hd, storage, flags, argv[i]);
+		if (ret < 0)
+			failed++;
+		else if (ret)
+			differ++;
+	}
+
+	printf("%d images, %d with unmatched boxes (IoU < %.2f), %d failed\n",
+	       argc - 1, differ, CASCADE_MATCH_IOU, failed);
+
+	cvReleaseMemStorage(&storage);
+	haar_detector_destroy(&hd);
+	haar_cascade_free(c);
+	cvReleaseHaarClassifierCascade(&cv);
+
+	return differ || failed;
+}
+
+int main(int argc, char *const argv[])
+{
+	CvHaarClassifierCascade *cv;
+	struct haar_cascade *c, *m;
+	int ret;
+
+	if (argc > 1 && !strcmp(argv[1], "--compare"))
+		return cascade_compare(argc - 2, argv + 2);
+
+	if (argc != 3) {
+		usage();
+		exit(1);
+	}
+
+	cv = (CvHaarClassifierCascade *) cvLoad(argv[1], 0, 0, 0);
+	if (!cv) {
+		fprintf(stderr, "error: can't load %s\n", argv[1]);
+		exit(1);
+	}
+
+	c = haar_cascade_from_cv(cv);
+	cvReleaseHaarClassifierCascade(&cv);
+	if (!c) {
+		fprintf(stderr, "error: %s can't be converted\n", argv[1]);
+		exit(1);
+	}
+
+	ret = haar_cascade_save(c, argv[2]);
+	if (ret) {
+		fprintf(stderr, "error: can't write %s: %s\n", argv[2],
+			strerror(-ret));
+		haar_cascade_free(c);
+		exit(1);
+	}
+
+	/* load it back the way the detector will */
+	m = haar_cascade_map(argv[2]);
+	if (!m || memcmp(m, c, c->size)) {
+		fprintf(stderr, "error: %s does not read back\n", argv[2]);
+		haar_cascade_free(c);
+		exit(1);
+	}
+
+	printf("%s: %dx%d window, %d stages, %d classifiers, %u bytes\n",
+	       argv[2], c->width, c->height, c->nstages, c->nclassifiers,
+	       c->size);
+
+	haar_cascade_unmap(m);
+	haar_cascade_free(c);
+
+	return 0;
+}
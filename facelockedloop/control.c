@@ -0,0 +1,193 @@
+/**
+ * @file facelockedloop/control.c
+ * @brief Servo controllers turning the target offset into duty corrections.
+ *
+ * Both controllers output a correction added to the commanded duty, the
+ * servo integrating it: the proportional term alone converges, the
+ * integral only removes what is left of a steady offset. The integral is
+ * bounded and frozen while the output saturates.
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "time_utils.h"
+#include "servolib.h"
+#include "control.h"
+
+/* smoothing of the predictive velocity estimate */
+#define PREDICT_ALPHA		0.5
+
+static
+double pid_update(struct controller *c, double error, int position, double dt)
+{
+	struct controller_params *p = &c->params;
+	double i = c->integral, d = 0;
+
+	if (p->ki > 0) {
+		i += error * dt;
+		if (p->ki * i > p->ilimit)
+			i = p->ilimit / p->ki;
+		else if (p->ki * i < -p->ilimit)
+			i = -p->ilimit / p->ki;
+	}
+	c->next_integral = i;
+
+	if (c->valid && dt > 0)
+		d = (error - c->last_error) / dt;
+
+	return p->kp * error + p->ki * i + p->kd * d;
+}
+
+/* where the target is, in duty, and where it will be after the lead */
+static
+double predictive_update(struct controller *c, double error, int position,
+			 double dt)
+{
+	struct controller_params *p = &c->params;
+	double target = position + p->kp * error;
+
+	if (c->valid && dt > 0)
+		c->velocity += PREDICT_ALPHA *
+			((target - c->last_target) / dt - c->velocity);
+	c->last_target = target;
+	c->next_integral = c->integral;
+
+	return p->kp * error + c->velocity * p->lead;
+}
+
+static const struct controller_ops controller_ops[] = {
+	[CONTROLLER_PID] = {
+		.name = "pid",
+		.update = pid_update,
+	},
+	[CONTROLLER_PREDICTIVE] = {
+		.name = "predictive",
+		.update = predictive_update,
+	},
+};
+
+void controller_defaults(struct controller_params *p)
+{
+	p->type = CONTROLLER_PID;
+	p->kp = CONTROLLER_KP;
+	p->ki = CONTROLLER_KI;
+	p->kd = CONTROLLER_KD;
+	p->ilimit = CONTROLLER_ILIMIT;
+	p->deadband = 0;
+	p->max_step = CONTROLLER_MAX_STEP;
+	p->lead = CONTROLLER_LEAD;
+}
+
+int controller_parse(const char *name, enum controller_type *type)
+{
+	unsigned int n;
+
+	for (n = 0; n < sizeof(controller_ops) / sizeof(controller_ops[0]); n++) {
+		if (!strcmp(name, controller_ops[n].name)) {
+			*type = n;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+/* kp[,ki[,kd]]: the gains not given keep their value */
+int controller_gains_parse(const char *s, struct controller_params *p)
+{
+	double g[3] = { p->kp, p->ki, p->kd };
+	int n;
+
+	n = sscanf(s, "%lf,%lf,%lf", &g[0], &g[1], &g[2]);
+	if (n < 1 || g[0] <= 0 || g[1] < 0 || g[2] < 0)
+		return -EINVAL;
+
+	p->kp = g[0];
+	p->ki = g[1];
+	p->kd = g[2];
+
+	return 0;
+}
+
+void controller_reset(struct controller *c)
+{
+	c->integral = 0;
+	c->next_integral = 0;
+	c->last_error = 0;
+	c->last_target = 0;
+	c->velocity = 0;
+	c->last = 0;
+	c->valid = 0;
+}
+
+int controller_init(struct controller *c, const struct controller_params *p)
+{
+	if (p->type > CONTROLLER_PREDICTIVE || p->kp <= 0 || p->max_step <= 0)
+		return -EINVAL;
+
+	c->ops = &controller_ops[p->type];
+	c->params = *p;
+	c->updates = 0;
+	c->saturated = 0;
+	controller_reset(c);
+
+	return 0;
+}
+
+/* the next position to command: position itself when nothing is to be done */
+int controller_update(struct controller *c, int error, int position,
+		      unsigned long long now)
+{
+	struct controller_params *p = &c->params;
+	double dt = 0, step;
+	int next, limited = 0;
+
+	if (c->valid && now - c->last > CONTROLLER_STALE_NSECS)
+		controller_reset(c);
+
+	if (c->valid)
+		dt = (double) (now - c->last) / FLL_NANOSECONDS_IN_SECOND;
+
+	if (abs(error) < p->deadband)
+		error = 0;
+
+	step = c->ops->update(c, error, position, dt);
+	c->last_error = error;
+	c->last = now;
+	c->valid = 1;
+	c->updates++;
+
+	if (step > p->max_step) {
+		step = p->max_step;
+		limited = 1;
+	} else if (step < -p->max_step) {
+		step = -p->max_step;
+		limited = 1;
+	}
+
+	next = position + lround(step);
+	if (next > MAX_DUTY) {
+		next = MAX_DUTY;
+		limited = 1;
+	} else if (next < MIN_DUTY) {
+		next = MIN_DUTY;
+		limited = 1;
+	}
+
+	/* conditional integration: a saturated output must not wind up */
+	if (limited)
+		c->saturated++;
+	else
+		c->integral = c->next_integral;
+
+	return error ? next : position;
+}
+
+void controller_print(const struct controller *c, const char *name)
+{
+	printf("%s: %s controller, %lu updates, %lu saturated.\n",
+	       name, c->ops->name, c->updates, c->saturated);
+}
@@ -0,0 +1,77 @@
+#ifndef __CONTROL_H_
+#define __CONTROL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum controller_type {
+	CONTROLLER_PID,
+	/* aims where a constant velocity target will be */
+	CONTROLLER_PREDICTIVE,
+};
+
+#define CONTROLLER_KP		0.05
+#define CONTROLLER_KI		0.01
+#define CONTROLLER_KD		0.0
+#define CONTROLLER_ILIMIT	5.0
+#define CONTROLLER_MAX_STEP	15
+#define CONTROLLER_LEAD		0.3
+/* a target unseen for longer starts again from scratch */
+#define CONTROLLER_STALE_NSECS	2000000000ULL
+
+/* errors are in pixels, everything the controller outputs in duty */
+struct controller_params {
+	enum controller_type type;
+	double kp;
+	double ki;
+	double kd;
+	/* anti-windup: bound of the integral contribution */
+	double ilimit;
+	/* errors smaller than this many pixels are left alone */
+	int deadband;
+	/* largest correction sent at once */
+	int max_step;
+	/* predictive: seconds ahead the target is aimed at */
+	double lead;
+};
+
+struct controller;
+
+struct controller_ops {
+	const char *name;
+	/* the correction to apply to position for this error */
+	double (*update)(struct controller *c, double error, int position,
+			 double dt);
+};
+
+struct controller {
+	const struct controller_ops *ops;
+	struct controller_params params;
+	double integral;
+	/* what update integrated, kept unless the output saturates */
+	double next_integral;
+	double last_error;
+	double last_target;
+	double velocity;
+	unsigned long long last;
+	int valid;
+	unsigned long updates;
+	unsigned long saturated;
+};
+
+void controller_defaults(struct controller_params *p);
+int controller_parse(const char *name, enum controller_type *type);
+int controller_gains_parse(const char *s, struct controller_params *p);
+
+int controller_init(struct controller *c, const struct controller_params *p);
+void controller_reset(struct controller *c);
+int controller_update(struct controller *c, int error, int position,
+		      unsigned long long now);
+void controller_print(const struct controller *c, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
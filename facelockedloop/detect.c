@@ -8,12 +8,16 @@
 #include <errno.h>
 #include <stdio.h>
 #include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "kernel_utils.h"
 #include "time_utils.h"
 #include "detect.h"
+#include "frame.h"
 #include "store.h"
+#include "preview.h"
 
 #include "objdetect/objdetect.hpp"
 #include "highgui/highgui_c.h"
@@ -42,25 +46,46 @@ int detect_stage_input(struct stage *stg, void **it)
 	algo = container_of(stg, struct detector, step);
 	stage_input(stg, &itin);
 
-	algo->params.srcframe = itin;
+	algo->frame = itin;
+	algo->params.srcframe = algo->frame->image;
+	stg->params.birth = algo->frame->birth;
 	algo->params.faceboxs = NULL;
 
-	if (!algo->params.scratchbuf)
-		return -EINVAL;
-
 	return 0;
 }
 
+static
+void detect_stage_release(struct stage *stg, void *it)
+{
+	/* boxes the tracker never got to see */
+	store_put(it);
+}
+
+static
+void detect_stage_hold(struct stage *stg, void *it)
+{
+	store_hold(it);
+}
+
 static
 void detect_teardown(struct detector *d)
 {
-	cvDestroyWindow("FLL detection");
+	if (d->params.preview_fps)
+		preview_destroy(&d->preview);
+
+	if (d->gray)
+		cvReleaseImage(&d->gray);
+	if (d->view)
+		cvReleaseImageHeader(&d->view);
+	d->params.dstframe = NULL;
 
-	if (d->params.dstframe)
-		cvReleaseImage(&(d->params.dstframe));
+	if (d->templ)
+		cvReleaseImage(&d->templ);
 
-	if (d->params.scratchbuf)
-		cvReleaseMemStorage(&(d->params.scratchbuf));
+	if (d->match)
+		cvReleaseImage(&d->match);
+
+	store_slab_destroy(&d->results);
 }
 
 static
@@ -69,86 +94,638 @@ void detect_stage_down(struct stage *stg)
 	struct detector *algo;
 
 	algo = container_of(stg, struct detector, step);
-	detect_teardown(algo);
 	stage_down(stg);
+	if (algo->params.detect_period != 1)
+		printf("detect: %lu frames followed, %lu cascade runs, "
+		       "%lu forced by a lost face.\n", algo->followed,
+		       algo->detections, algo->follow_lost);
+	hist_print(&algo->pool_wait, "engine");
+	detect_teardown(algo);
 	pipeline_deregister(stg->pipeline, stg);
 }
 
 static
-struct store_box* detect_store(CvSeq* faces, IplImage* img, int scale)
+struct store_box* detect_store(struct store_slab *slab, struct haar_box *faces,
+			       int nfaces, CvPoint offset, int scale)
 {
 	struct store_box *bbpos;
-	CvPoint ptA, ptB;
 	int nbbox, i;
-	CvFont font;
-	char *text;
 
-	nbbox = faces->total ? faces->total : 1;
-	bbpos = calloc(nbbox, sizeof(*bbpos));
+	bbpos = store_get(slab);
 	if (!bbpos)
 		return NULL;
 
-	if (!faces || !faces->total) {
+	memset(bbpos, 0, sizeof(*bbpos));
+	if (nfaces <= 0) {
 		bbpos->scan = 1;
+		store_set_count(bbpos, 0);
 		goto done;
 	}
 
-	cvInitFont(&font, CV_FONT_HERSHEY_PLAIN, 1.0, 1.0, 0, 1, 8);
+	nbbox = nfaces < STORE_MAX_BOXES ? nfaces : STORE_MAX_BOXES;
+	store_set_count(bbpos, nbbox);
 
-	for (i = 0; i < faces->total; i++) {
-		CvRect* rAB = (CvRect*)cvGetSeqElem(faces, i);
-		ptA.x = rAB->x * scale;
-		ptB.x = (rAB->x + rAB->width)*scale;
-		ptA.y = rAB->y*scale;
-		ptB.y = (rAB->y+rAB->height)*scale;
-		cvRectangle(img, ptA, ptB, CV_RGB(0,255,0), 2, 5, 0 );
+	for (i = 0; i < nbbox; i++) {
+		struct haar_box *rAB = &faces[i];
 
-		bbpos[i].ptA_x = ptA.x;
-		bbpos[i].ptA_y = ptA.y;
-		bbpos[i].ptB_x = ptB.x;
-		bbpos[i].ptB_y = ptB.y;
-
-		asprintf(&text, "detected: %dx%d", rAB->width, rAB->height);
-		ptB.y += 15;
-		ptB.x = ptA.x;
-		cvPutText(img, text, ptB, &font, CV_RGB(0,255,0));
-
-		free(text);
+		bbpos[i].scan = 0;
+		bbpos[i].ptA_x = (offset.x + rAB->x) * scale;
+		bbpos[i].ptA_y = (offset.y + rAB->y) * scale;
+		bbpos[i].ptB_x = (offset.x + rAB->x + rAB->width) * scale;
+		bbpos[i].ptB_y = (offset.y + rAB->y + rAB->height) * scale;
+		bbpos[i].score = rAB->neighbors;
+		bbpos[i].id = 0;
 	}
 done:
 	return bbpos;
 }
 
+/* a frame box in the coordinates of the downscaled gray image */
 static
-int detect_run(struct detector *d)
+void detect_scaled(struct detector *d, const struct store_box *b,
+		   struct store_box *scaled)
 {
-	CvSeq* faces;
+	int s = d->params.downscale;
 
-	if (!d->params.dstframe) {
-		printf("allocate gray image only once\n");
-		d->params.dstframe = cvCreateImage(cvSize(d->params.srcframe->width, d->params.srcframe->height),
-							  d->params.srcframe->depth, 1);
-		if (!d->params.dstframe)
-			return -ENOMEM;
+	scaled->scan = b->scan;
+	scaled->ptA_x = b->ptA_x / s;
+	scaled->ptA_y = b->ptA_y / s;
+	scaled->ptB_x = b->ptB_x / s;
+	scaled->ptB_y = b->ptB_y / s;
+}
+
+/*
+ * BGR to gray and s x s box averaging in one pass over the source:
+ * out[x, y] is the luma of the mean colour of its block. area is in
+ * the coordinates of the output, the source is read only once.
+ */
+static
+void detect_gray_downscale(const IplImage *src, IplImage *dst, CvRect area,
+			   int s)
+{
+	/* BT.601 luma, Q16, folding the 1/s^2 of the average */
+	const unsigned int cb = (7471 + s * s / 2) / (s * s);
+	const unsigned int cg = (38470 + s * s / 2) / (s * s);
+	const unsigned int cr = (19595 + s * s / 2) / (s * s);
+	const unsigned char *row, *p;
+	unsigned int b, g, r;
+	unsigned char *out;
+	int x, y, i, j;
+
+	for (y = area.y; y < area.y + area.height; y++) {
+		out = (unsigned char *) dst->imageData + y * dst->widthStep;
+		row = (const unsigned char *) src->imageData +
+			y * s * src->widthStep;
+
+		for (x = area.x; x < area.x + area.width; x++) {
+			b = g = r = 0;
+			for (j = 0; j < s; j++) {
+				p = row + j * src->widthStep + x * s * 3;
+				for (i = 0; i < s; i++, p += 3) {
+					b += p[0];
+					g += p[1];
+					r += p[2];
+				}
+			}
+			out[x] = (b * cb + g * cg + r * cr + (1 << 15)) >> 16;
+		}
 	}
+}
 
+/*
+ * the luma of YUYV and GREY frames is read in place: every step bytes
+ * of a row, averaged over s x s blocks.
+ */
+static
+void detect_luma_downscale(const IplImage *src, IplImage *dst, CvRect area,
+			   int s, int step)
+{
+	const unsigned int div = s * s;
+	const unsigned char *row, *p;
+	unsigned char *out;
+	unsigned int y0;
+	int x, y, i, j;
+
+	for (y = area.y; y < area.y + area.height; y++) {
+		out = (unsigned char *) dst->imageData + y * dst->widthStep;
+		row = (const unsigned char *) src->imageData +
+			y * s * src->widthStep;
+
+		for (x = area.x; x < area.x + area.width; x++) {
+			y0 = 0;
+			for (j = 0; j < s; j++) {
+				p = row + j * src->widthStep + x * s * step;
+				for (i = 0; i < s; i++, p += step)
+					y0 += *p;
+			}
+			out[x] = (y0 + div / 2) / div;
+		}
+	}
+}
+
+/* only convert what is going to be looked at */
+static
+void detect_gray(struct detector *d, CvRect area)
+{
+	switch (d->frame->format) {
+	case FRAME_YUYV:
+		detect_luma_downscale(d->params.srcframe, d->params.dstframe,
+				      area, d->params.downscale, 2);
+		return;
+	case FRAME_GREY:
+		/* at full size the frame itself is the gray image */
+		if (d->params.downscale > 1)
+			detect_luma_downscale(d->params.srcframe,
+					      d->params.dstframe, area,
+					      d->params.downscale, 1);
+		return;
+	case FRAME_BGR:
+		break;
+	}
+
+	if (d->params.downscale > 1) {
+		detect_gray_downscale(d->params.srcframe, d->params.dstframe,
+				      area, d->params.downscale);
+		return;
+	}
+
+	cvSetImageROI(d->params.srcframe, area);
+	cvSetImageROI(d->params.dstframe, area);
 	cvCvtColor(d->params.srcframe, d->params.dstframe, CV_BGR2GRAY);
-	cvClearMemStorage(d->params.scratchbuf);
+	cvResetImageROI(d->params.srcframe);
+	cvResetImageROI(d->params.dstframe);
+}
+
+/*
+ * search around the last face found, expanded by roi_margin percent on
+ * every side; every roi_period frames fall back to a full frame scan.
+ */
+static
+int detect_roi(struct detector *d, CvRect *roi)
+{
+	struct store_box scaled, *last = &scaled;
+	int x0, y0, x1, y1, mx, my;
+
+	if (!d->params.roi_period || !d->tracked)
+		return 0;
+
+	if (++d->roi_frames >= d->params.roi_period) {
+		d->roi_frames = 0;
+		return 0;
+	}
+
+	detect_scaled(d, &d->last, last);
+	mx = (last->ptB_x - last->ptA_x) * d->params.roi_margin / 100;
+	my = (last->ptB_y - last->ptA_y) * d->params.roi_margin / 100;
+
+	x0 = last->ptA_x - mx > 0 ? last->ptA_x - mx : 0;
+	y0 = last->ptA_y - my > 0 ? last->ptA_y - my : 0;
+	x1 = last->ptB_x + mx < roi->width ? last->ptB_x + mx : roi->width;
+	y1 = last->ptB_y + my < roi->height ? last->ptB_y + my : roi->height;
+
+	if (x1 - x0 < d->min_size || y1 - y0 < d->min_size)
+		return 0;
+
+	*roi = cvRect(x0, y0, x1 - x0, y1 - y0);
+
+	return 1;
+}
+
+static
+int detect_faces_cv(struct detector *d, struct detect_engine *e,
+		    struct haar_box *boxes, int max)
+{
+	CvAvgComp *comp;
+	CvSeq *faces;
+	int i, n;
+
+	cvClearMemStorage(e->scratchbuf);
 	faces = cvHaarDetectObjects(d->params.dstframe,
-		(CvHaarClassifierCascade*)(d->params.algorithm),
-		d->params.scratchbuf,
+		(CvHaarClassifierCascade*)(d->params.pool->algorithm),
+		e->scratchbuf,
 		1.2, /* default scale factor: 1.1 */
 		2,   /* default min neighbours: 3 */
-		CV_HAAR_DO_CANNY_PRUNING | CV_HAAR_FIND_BIGGEST_OBJECT,
-		cvSize(d->params.min_size,d->params.min_size),
-		cvSize(d->params.max_size,d->params.max_size) );
+		CV_HAAR_DO_CANNY_PRUNING,
+		cvSize(d->min_size, d->min_size),
+		cvSize(d->max_size, d->max_size));
+	if (!faces)
+		return 0;
+
+	n = faces->total < max ? faces->total : max;
+	for (i = 0; i < n; i++) {
+		comp = (CvAvgComp*)cvGetSeqElem(faces, i);
+		boxes[i].x = comp->rect.x;
+		boxes[i].y = comp->rect.y;
+		boxes[i].width = comp->rect.width;
+		boxes[i].height = comp->rect.height;
+		boxes[i].neighbors = comp->neighbors;
+	}
 
-	d->params.faceboxs = detect_store(faces, d->params.srcframe, 1);
-	if (!d->params.faceboxs)
+	return n;
+}
+
+static
+int detect_faces_native(struct detector *d, struct detect_engine *e,
+			CvRect area, struct haar_box *boxes, int max)
+{
+	IplImage *gray = d->params.dstframe;
+	struct haar_params hp = {
+		.scale_factor = 1.2,
+		.min_neighbors = 2,
+		.min_size = d->min_size,
+		.max_size = d->max_size,
+		.biggest = 0,
+	};
+
+	return haar_detect(&e->haar, (unsigned char *) gray->imageData +
+			   area.y * gray->widthStep + area.x,
+			   area.width, area.height, gray->widthStep,
+			   &hp, boxes, max);
+}
+
+static
+int detect_box_cmp(const void *a, const void *b)
+{
+	const struct haar_box *p = a, *q = b;
+
+	return q->width * q->height - p->width * p->height;
+}
+
+static
+void detect_pool_unlock(void *arg)
+{
+	struct detect_pool *pool = arg;
+
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * take a ticket and wait for it to be served with an engine free. The
+ * stages are cancelled on teardown, the lock must not go with them; a
+ * ticket abandoned that way is only ever followed by detectors being
+ * torn down as well.
+ */
+static
+struct detect_engine *detect_pool_get(struct detect_pool *pool)
+{
+	unsigned long ticket;
+	int n = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	pthread_cleanup_push(detect_pool_unlock, pool);
+
+	ticket = pool->next_ticket++;
+	for (;;) {
+		if (ticket == pool->serving) {
+			for (n = 0; n < pool->nengines; n++)
+				if (!(pool->busy & (1U << n)))
+					break;
+			if (n < pool->nengines)
+				break;
+		}
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	}
+	pool->busy |= 1U << n;
+	pool->serving++;
+	pthread_cond_broadcast(&pool->cond);
+
+	pthread_cleanup_pop(1);
+
+	return &pool->engines[n];
+}
+
+static
+void detect_pool_put(struct detect_pool *pool, struct detect_engine *e)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->busy &= ~(1U << (e - pool->engines));
+	e->runs++;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static
+int detect_faces(struct detector *d, CvRect area)
+{
+	struct detect_pool *pool = d->params.pool;
+	struct detect_engine *e;
+	unsigned long long start;
+	int n;
+
+	detect_gray(d, area);
+	cvSetImageROI(d->params.dstframe, area);
+
+	start = monotonic_nsecs();
+	e = detect_pool_get(pool);
+	hist_record(&d->pool_wait, monotonic_nsecs() - start);
+
+	if (pool->odt == CDT_HAAR_NATIVE)
+		n = detect_faces_native(d, e, area, d->boxes, STORE_MAX_BOXES);
+	else
+		n = detect_faces_cv(d, e, d->boxes, STORE_MAX_BOXES);
+	detect_pool_put(pool, e);
+	cvResetImageROI(d->params.dstframe);
+
+	/* the largest face first: the one the ROI and follower stay on */
+	if (n > 1)
+		qsort(d->boxes, n, sizeof(d->boxes[0]), detect_box_cmp);
+
+	return n;
+}
+
+static
+int detect_overlap(const struct store_box *a, const struct store_box *b)
+{
+	int w, h, inter, uni;
+
+	w = (a->ptB_x < b->ptB_x ? a->ptB_x : b->ptB_x) -
+		(a->ptA_x > b->ptA_x ? a->ptA_x : b->ptA_x);
+	h = (a->ptB_y < b->ptB_y ? a->ptB_y : b->ptB_y) -
+		(a->ptA_y > b->ptA_y ? a->ptA_y : b->ptA_y);
+	if (w <= 0 || h <= 0)
+		return 0;
+
+	inter = w * h;
+	uni = (a->ptB_x - a->ptA_x) * (a->ptB_y - a->ptA_y) +
+		(b->ptB_x - b->ptA_x) * (b->ptB_y - b->ptA_y) - inter;
+
+	return inter * 100 / uni;
+}
+
+/*
+ * a face keeps the id of the face it overlaps most in the previous
+ * results, if it overlaps it enough; every other one is new.
+ */
+static
+void detect_identify(struct detector *d, struct store_box *boxes, int n)
+{
+	int taken[STORE_MAX_BOXES] = { 0 };
+	int i, j, best, overlap, most;
+
+	/* a missed detection does not make the faces new */
+	if (!n)
+		return;
+
+	for (i = 0; i < n; i++) {
+		best = -1;
+		most = DETECT_SAME_FACE;
+		for (j = 0; j < d->nfaces; j++) {
+			if (taken[j])
+				continue;
+			overlap = detect_overlap(&boxes[i], &d->faces[j]);
+			if (overlap >= most) {
+				most = overlap;
+				best = j;
+			}
+		}
+
+		if (best < 0) {
+			boxes[i].id = ++d->next_id;
+			continue;
+		}
+
+		taken[best] = 1;
+		boxes[i].id = d->faces[best].id;
+	}
+
+	memcpy(d->faces, boxes, n * sizeof(boxes[0]));
+	d->nfaces = n;
+}
+
+/* keep what the face looks like: the gray frame still holds it */
+static
+void detect_follow_start(struct detector *d, struct store_box *b)
+{
+	CvRect r = cvRect(b->ptA_x, b->ptA_y, b->ptB_x - b->ptA_x,
+			  b->ptB_y - b->ptA_y);
+
+	d->follow = 0;
+	if (r.width < DETECT_FOLLOW_MIN || r.height < DETECT_FOLLOW_MIN)
+		return;
+
+	cvSetImageROI(d->params.dstframe, r);
+	cvSetImageROI(d->templ, cvRect(0, 0, r.width, r.height));
+	cvCopy(d->params.dstframe, d->templ, NULL);
+	cvResetImageROI(d->params.dstframe);
+	d->follow = 1;
+}
+
+/*
+ * look for the template around where it was last seen; the normalized
+ * correlation of the best match is the confidence.
+ */
+static
+int detect_follow(struct detector *d)
+{
+	CvRect t = cvGetImageROI(d->templ);
+	struct store_box scaled, *last = &scaled;
+	int width = d->params.dstframe->width;
+	int height = d->params.dstframe->height;
+	int x0, y0, x1, y1, mx, my;
+	double confidence;
+	CvPoint loc;
+
+	detect_scaled(d, &d->last, last);
+
+	mx = t.width * DETECT_FOLLOW_MARGIN / 100 + 1;
+	my = t.height * DETECT_FOLLOW_MARGIN / 100 + 1;
+
+	x0 = last->ptA_x - mx > 0 ? last->ptA_x - mx : 0;
+	y0 = last->ptA_y - my > 0 ? last->ptA_y - my : 0;
+	x1 = last->ptB_x + mx < width ? last->ptB_x + mx : width;
+	y1 = last->ptB_y + my < height ? last->ptB_y + my : height;
+
+	if (x1 - x0 < t.width || y1 - y0 < t.height)
+		return 0;
+
+	detect_gray(d, cvRect(x0, y0, x1 - x0, y1 - y0));
+	cvSetImageROI(d->params.dstframe, cvRect(x0, y0, x1 - x0, y1 - y0));
+
+	cvSetImageROI(d->match, cvRect(0, 0, x1 - x0 - t.width + 1,
+				       y1 - y0 - t.height + 1));
+	cvMatchTemplate(d->params.dstframe, d->templ, d->match,
+			CV_TM_CCOEFF_NORMED);
+	cvMinMaxLoc(d->match, NULL, &confidence, NULL, &loc, NULL);
+	cvResetImageROI(d->params.dstframe);
+
+	d->confidence = confidence;
+	if (confidence < d->params.follow_confidence)
+		return 0;
+	d->boxes[0].neighbors = confidence * 100;
+
+	d->boxes[0].x = x0 + loc.x;
+	d->boxes[0].y = y0 + loc.y;
+	d->boxes[0].width = t.width;
+	d->boxes[0].height = t.height;
+
+	return 1;
+}
+
+/* the cascade runs every detect_period frames, 0 only when the face is lost */
+static
+int detect_follow_due(struct detector *d)
+{
+	int target = __atomic_load_n(&d->target, __ATOMIC_RELAXED);
+
+	if (d->params.detect_period == 1 || !d->follow || !d->tracked)
+		return 0;
+
+	/* the tracker went for another face: find it first */
+	if (target && target != d->last.id)
+		return 0;
+
+	return !d->params.detect_period ||
+		d->since_detect < d->params.detect_period - 1;
+}
+
+static
+int detect_buffers(struct detector *d)
+{
+	int width = d->params.srcframe->width / d->params.downscale;
+	int height = d->params.srcframe->height / d->params.downscale;
+
+	printf("allocate gray image only once\n");
+	d->gray = cvCreateImage(cvSize(width, height), IPL_DEPTH_8U, 1);
+	d->view = cvCreateImageHeader(cvSize(width, height), IPL_DEPTH_8U, 1);
+	if (!d->gray || !d->view)
 		return -ENOMEM;
 
-	cvShowImage("FLL detection", (CvArr*)(d->params.srcframe));
-	cvWaitKey(5);
+	if (d->params.detect_period == 1)
+		return 0;
+
+	d->templ = cvCreateImage(cvSize(width, height), IPL_DEPTH_8U, 1);
+	d->match = cvCreateImage(cvSize(width, height), IPL_DEPTH_32F, 1);
+	if (!d->templ || !d->match)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/* the face the tracker follows, the largest one if it has none */
+static
+struct store_box *detect_seed(struct detector *d, struct store_box *boxes,
+			      int n)
+{
+	int target = __atomic_load_n(&d->target, __ATOMIC_RELAXED);
+	int i;
+
+	for (i = 0; target && i < n; i++)
+		if (boxes[i].id == target)
+			return &boxes[i];
+
+	return &boxes[0];
+}
+
+/*
+ * only the followed face was looked for: it keeps its id, the others
+ * are reported where they were last seen.
+ */
+static
+void detect_follow_store(struct detector *d, struct store_box *boxes)
+{
+	int i, n = 1;
+
+	boxes[0].id = d->last.id;
+	for (i = 0; i < d->nfaces && n < STORE_MAX_BOXES; i++)
+		if (d->faces[i].id != d->last.id)
+			boxes[n++] = d->faces[i];
+	store_set_count(boxes, n);
+
+	memcpy(d->faces, boxes, n * sizeof(boxes[0]));
+	d->nfaces = n;
+}
+
+static
+int detect_run(struct detector *d)
+{
+	struct store_box *seed, scaled;
+	CvRect area;
+	int faces, followed = 0;
+	int roi, ret;
+
+	if (!d->gray) {
+		ret = detect_buffers(d);
+		if (ret)
+			return ret;
+	}
+
+	/* a slot per result each consumer queues or holds, one being filled */
+	if (!d->results.slots) {
+		ret = store_slab_init(&d->results,
+				      stage_output_depth(&d->step) + 1);
+		if (ret)
+			return ret;
+	}
+
+	/* a full size GREY frame is looked at where it is */
+	if (d->frame->format == FRAME_GREY && d->params.downscale == 1) {
+		cvSetData(d->view, d->params.srcframe->imageData,
+			  d->params.srcframe->widthStep);
+		d->params.dstframe = d->view;
+	} else
+		d->params.dstframe = d->gray;
+
+	if (detect_follow_due(d)) {
+		faces = detect_follow(d);
+		if (faces) {
+			followed = 1;
+			d->followed++;
+			d->since_detect++;
+			area = cvRect(0, 0, d->params.dstframe->width,
+				      d->params.dstframe->height);
+			goto store;
+		}
+		/* not confident any more: back to the cascade */
+		d->follow_lost++;
+	}
+
+	d->detections++;
+	d->since_detect = 0;
+	area = cvRect(0, 0, d->params.dstframe->width, d->params.dstframe->height);
+	roi = detect_roi(d, &area);
+	faces = detect_faces(d, area);
+
+	if (roi && faces <= 0) {
+		/* the face left the region: look for it everywhere */
+		d->roi_misses++;
+		d->roi_frames = 0;
+		area = cvRect(0, 0, d->params.dstframe->width,
+			      d->params.dstframe->height);
+		faces = detect_faces(d, area);
+	}
+
+store:
+	d->params.faceboxs = detect_store(&d->results, d->boxes, faces,
+					  cvPoint(area.x, area.y),
+					  d->params.downscale);
+	if (!d->params.faceboxs)
+		return -ENOBUFS;
+
+	store_stamp(d->params.faceboxs, d->frame->birth, d->frame->exposure);
+	if (followed)
+		detect_follow_store(d, d->params.faceboxs);
+	else
+		detect_identify(d, d->params.faceboxs,
+				store_count(d->params.faceboxs));
+
+	d->tracked = !d->params.faceboxs->scan;
+	if (d->tracked) {
+		/* the ROI and the follower stay on the tracker's face */
+		seed = detect_seed(d, d->params.faceboxs,
+				   store_count(d->params.faceboxs));
+		d->last = *seed;
+
+		/* a fresh detection: the face may look different by now */
+		if (!followed && d->templ) {
+			detect_scaled(d, seed, &scaled);
+			detect_follow_start(d, &scaled);
+		}
+	}
+
+	/* the overlay is only drawn if somebody is watching */
+	if (d->params.preview_fps)
+		preview_post(&d->preview, d->frame, d->params.faceboxs,
+			     d->tracked ? store_count(d->params.faceboxs) : 0);
 
 	return 0;
 }
@@ -168,6 +745,11 @@ int detect_stage_run(struct stage *stg)
 	/* pass only first face detected to next stage */
 	stg->params.data_out = algo->params.faceboxs;
 
+	/* the boxes are all the tracker needs, give the buffer back */
+	algo->params.srcframe = NULL;
+	frame_put(algo->frame);
+	algo->frame = NULL;
+
 	return ret;
 }
 
@@ -180,34 +762,198 @@ struct stage_ops detect_ops = {
 	.up = detect_stage_up,
 	.wait = stage_wait,
 	.go = stage_go,
+	.release = detect_stage_release,
+	.hold = detect_stage_hold,
 };
 
+static
+void detect_pool_unload(struct detect_pool *pool)
+{
+	if (pool->cascade) {
+		if (pool->mapped)
+			haar_cascade_unmap(pool->cascade);
+		else
+			haar_cascade_free(pool->cascade);
+		pool->cascade = NULL;
+	}
+
+	if (pool->algorithm)
+		cvReleaseHaarClassifierCascade((CvHaarClassifierCascade **)
+					       &pool->algorithm);
+}
+
+/*
+ * the native evaluator maps a precompiled cascade when it is given one;
+ * otherwise the XML is parsed and, if needed, converted in memory.
+ */
+static
+int detect_pool_load(struct detect_pool *pool)
+{
+	if (pool->odt == CDT_HAAR_NATIVE && pool->cascade_bin) {
+		pool->cascade = haar_cascade_map(pool->cascade_bin);
+		if (!pool->cascade) {
+			printf("error: can't map %s\n", pool->cascade_bin);
+			return -ENOENT;
+		}
+		pool->mapped = 1;
+
+		return 0;
+	}
+
+	if (access(pool->cascade_xml, F_OK) ||
+	    access(pool->cascade_xml, R_OK)) {
+		printf("error: can't open %s\n", pool->cascade_xml);
+		return -ENOENT;
+	}
+
+	pool->algorithm = (void*) cvLoad(pool->cascade_xml, 0, 0, 0 );
+	if (!pool->algorithm)
+		return -ENOENT;
+
+	if (pool->odt != CDT_HAAR_NATIVE)
+		return 0;
+
+	pool->cascade = haar_cascade_from_cv(pool->algorithm);
+	if (!pool->cascade)
+		return -EINVAL;
+
+	return 0;
+}
+
+static
+int detect_engine_init(struct detect_pool *pool, struct detect_engine *e,
+		       int threads)
+{
+	int ret;
+
+	e->runs = 0;
+	if (pool->odt != CDT_HAAR_NATIVE) {
+		e->scratchbuf = cvCreateMemStorage(0);
+		return e->scratchbuf ? 0 : -ENOMEM;
+	}
+
+	ret = haar_detector_init(&e->haar, pool->cascade);
+	if (!ret)
+		ret = haar_detector_threads(&e->haar, threads);
+	if (ret)
+		haar_detector_destroy(&e->haar);
+
+	return ret;
+}
+
+static
+void detect_engine_destroy(struct detect_pool *pool, struct detect_engine *e)
+{
+	if (pool->odt != CDT_HAAR_NATIVE)
+		cvReleaseMemStorage((CvMemStorage **) &e->scratchbuf);
+	else
+		haar_detector_destroy(&e->haar);
+}
+
+/*
+ * the native engines only read the cascade and share it; an OpenCV
+ * cascade caches per image state, so it gets a single engine.
+ */
+int detect_pool_init(struct detect_pool *pool, enum object_detector_t odt,
+		     char *cascade_xml, char *cascade_bin, int engines,
+		     int threads)
+{
+	int ret;
+
+	if (engines < 1 || engines > DETECT_MAX_ENGINES)
+		return -EINVAL;
+
+	memset(pool, 0, sizeof(*pool));
+	pool->odt = odt;
+	pool->cascade_xml = cascade_xml;
+	pool->cascade_bin = cascade_bin;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	ret = detect_pool_load(pool);
+	if (ret)
+		goto error;
+
+	if (odt != CDT_HAAR_NATIVE)
+		engines = 1;
+
+	for (; pool->nengines < engines; pool->nengines++) {
+		ret = detect_engine_init(pool, &pool->engines[pool->nengines],
+					 threads);
+		if (ret)
+			goto error;
+	}
+
+	return 0;
+error:
+	detect_pool_destroy(pool);
+
+	return ret;
+}
+
+void detect_pool_destroy(struct detect_pool *pool)
+{
+	int n;
+
+	for (n = 0; n < pool->nengines; n++) {
+		printf("detect: engine %d, %lu cascade runs.\n", n,
+		       pool->engines[n].runs);
+		detect_engine_destroy(pool, &pool->engines[n]);
+	}
+	pool->nengines = 0;
+
+	detect_pool_unload(pool);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+}
+
 int detect_initialize(struct detector *d, struct detector_params *p,
 		      struct pipeline *pipe)
 {
 	struct stage_params stgparams;
 	int ret = 0;
 
-	if (access(p->cascade_xml, F_OK) || access(p->cascade_xml, R_OK)) {
-		printf("error: can't open %s\n", p->cascade_xml);
-		return -ENOENT;
-	}
-
 	stgparams.nth_stage = DETECTION_STAGE;
+	stgparams.upstream = CAPTURE_STAGE;
 	stgparams.data_out = NULL;
 	stgparams.data_in = NULL;
 	d->params = *p;
+	d->tracked = 0;
+	d->roi_frames = 0;
+	d->roi_misses = 0;
+	d->templ = NULL;
+	d->match = NULL;
+	d->gray = NULL;
+	d->view = NULL;
+	d->nfaces = 0;
+	d->next_id = 0;
+	d->target = 0;
+
+	/* the cascade looks at the downscaled image */
+	if (d->params.downscale < 1)
+		d->params.downscale = 1;
+	d->min_size = d->params.min_size / d->params.downscale;
+	d->max_size = d->params.max_size / d->params.downscale;
+	d->follow = 0;
+	d->since_detect = 0;
+	d->confidence = 0;
+	d->followed = 0;
+	d->detections = 0;
+	d->follow_lost = 0;
+	hist_reset(&d->pool_wait);
+
+	if (!d->params.pool)
+		return -EINVAL;
 
-	cvNamedWindow("FLL detection", CV_WINDOW_AUTOSIZE);
-
-	d->params.scratchbuf = cvCreateMemStorage(0);
-	if (d->params.scratchbuf == NULL)
-		return -ENOMEM;
-
-	d->params.algorithm = (void*) cvLoad(d->params.cascade_xml, 0, 0, 0 );
-	if (!d->params.algorithm)
-		return -ENOENT;
+	if (d->params.preview_fps) {
+		ret = preview_init(&d->preview, d->params.name,
+				   d->params.preview_fps);
+		if (ret)
+			return ret;
+	}
 
+	/* sized once every consumer is known, see detect_run() */
+	d->results.slots = NULL;
 
 	detect_stage_up(&d->step, &stgparams, &detect_ops, pipe);
 
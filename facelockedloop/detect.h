@@ -6,51 +6,147 @@ extern "C" {
 #endif
 
 #include "pipeline.h"
+#include "store.h"
+#include "haar.h"
+#include "preview.h"
 
 #if defined(HAVE_OPENCV2)
 #include "highgui/highgui_c.h"
 #endif
   
+/* between detections the face is followed by template matching */
+#define DETECT_FOLLOW_CONFIDENCE	0.6
+/* search this percentage of the face size around its last position */
+#define DETECT_FOLLOW_MARGIN		25
+#define DETECT_FOLLOW_MIN		8
+#define DETECT_MAX_DOWNSCALE		4
+/* overlap, in percent of the union, of one face seen in two frames */
+#define DETECT_SAME_FACE		30
+/* cascade evaluators shared by the detectors of every camera */
+#define DETECT_MAX_ENGINES		4
+
 enum object_detector_t {
 	CDT_HAAR = 0,
-	CDT_UNKNOWN = 1,
+	CDT_HAAR_NATIVE = 1,
+	CDT_UNKNOWN = 2,
+};
+
+/* one cascade evaluation in progress at a time */
+struct detect_engine {
+	struct haar_detector haar;
+	/* CvMemStorage of the OpenCV evaluator */
+	void *scratchbuf;
+	unsigned long runs;
+};
+
+/*
+ * a single loaded cascade and the engines evaluating it; detectors are
+ * served in the order they asked for an engine, so that no camera
+ * starves the others.
+ */
+struct detect_pool {
+	enum object_detector_t odt;
+	char *cascade_xml;
+	char *cascade_bin;
+	void *algorithm;
+	struct haar_cascade *cascade;
+	int mapped;
+	struct detect_engine engines[DETECT_MAX_ENGINES];
+	int nengines;
+	unsigned int busy;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long next_ticket;
+	unsigned long serving;
 };
 
 #if defined(HAVE_OPENCV2)
 
 struct detector_params {
-	CvMemStorage* scratchbuf;
 	IplImage* srcframe;
 	IplImage* dstframe;
-	enum object_detector_t odt;
+	struct detect_pool *pool;
 	struct store_box *faceboxs;
-	char *cascade_xml;
-	void *algorithm;
+	/* of the preview window */
+	char *name;
 	int min_size;
 	int max_size;
+	int roi_period;
+	int roi_margin;
+	/* run the cascade every detect_period frames, 0: when the face is lost */
+	int detect_period;
+	double follow_confidence;
+	/* detect on a 1/downscale image */
+	int downscale;
+	/* 0: headless */
+	int preview_fps;
 };
 
 #else
 struct detector_params {
-	enum object_detector_t odt;
+	struct detect_pool *pool;
 	struct store_box *faceboxs;
-	char *cascade_xml;
-	void *scratchbuf;
-	void *algorithm;
+	char *name;
 	void* srcframe;
 	void* dstframe;
 	int min_size;
 	int max_size;
+	int roi_period;
+	int roi_margin;
+	/* run the cascade every detect_period frames, 0: when the face is lost */
+	int detect_period;
+	double follow_confidence;
+	/* detect on a 1/downscale image */
+	int downscale;
+	/* 0: headless */
+	int preview_fps;
 };
 
 #endif
 
+struct frame;
+
 struct detector {
 	struct stage step;
 	struct detector_params params;
+	struct frame *frame;
+	struct store_slab results;
+	struct haar_box boxes[STORE_MAX_BOXES];
+	struct preview preview;
+	struct store_box last;
+	/* the previous results, to carry the face ids over */
+	struct store_box faces[STORE_MAX_BOXES];
+	int nfaces;
+	int next_id;
+	/* id of the face the tracker follows, 0 if none; it writes it */
+	int target;
+	/* face sizes, in downscaled pixels */
+	int min_size;
+	int max_size;
+	unsigned long roi_misses;
+	int roi_frames;
+	/* the gray image, or a view of a GREY frame used as it is */
+	IplImage *gray;
+	IplImage *view;
+	/* the face template being followed, and where it matches */
+	IplImage *templ;
+	IplImage *match;
+	double confidence;
+	int follow;
+	int since_detect;
+	unsigned long followed;
+	unsigned long detections;
+	unsigned long follow_lost;
+	/* time spent waiting for an engine of the pool */
+	struct hist pool_wait;
+	int tracked;
 	int status;
 };
   
+int detect_pool_init(struct detect_pool *pool, enum object_detector_t odt,
+		     char *cascade_xml, char *cascade_bin, int engines,
+		     int threads);
+void detect_pool_destroy(struct detect_pool *pool);
 int detect_initialize(struct detector *d, struct detector_params *p, struct pipeline *pipe);
 
 #ifdef __cplusplus
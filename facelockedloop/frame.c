@@ -0,0 +1,144 @@
+/**
+ * @file facelockedloop/frame.c
+ * @brief Preallocated, reference counted frame buffers.
+ *
+ * The imager fills a buffer taken from the pool and every stage that
+ * keeps it holds a reference; the last one to let go returns the buffer.
+ * An external pool only has image headers, pointed at buffers owned by
+ * somebody else, who gets each one back with the frame.
+ */
+#include <errno.h>
+#include <string.h>
+
+#include "frame.h"
+
+int frame_pool_init(struct frame_pool *pool, int count, int width, int height,
+		    int depth, int channels)
+{
+	struct frame *f;
+	int n;
+
+	if (count <= 0 || count > FRAME_POOL_MAX)
+		return -EINVAL;
+
+	memset(pool, 0, sizeof(*pool));
+	pthread_mutex_init(&pool->lock, NULL);
+
+	for (n = 0; n < count; n++) {
+		f = &pool->frames[n];
+		f->image = cvCreateImage(cvSize(width, height), depth, channels);
+		if (!f->image) {
+			frame_pool_destroy(pool);
+			return -ENOMEM;
+		}
+		f->pool = pool;
+		f->format = channels == 1 ? FRAME_GREY : FRAME_BGR;
+		f->buffer = -1;
+		f->next = n + 1 < count ? n + 1 : -1;
+		pool->count++;
+	}
+	pool->free = 0;
+
+	return 0;
+}
+
+int frame_pool_init_external(struct frame_pool *pool, int count, int width,
+			     int height, int channels, enum frame_format format,
+			     void (*release)(struct frame *f), void *owner)
+{
+	struct frame *f;
+	int n;
+
+	if (count <= 0 || count > FRAME_POOL_MAX)
+		return -EINVAL;
+
+	memset(pool, 0, sizeof(*pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->release = release;
+	pool->owner = owner;
+
+	for (n = 0; n < count; n++) {
+		f = &pool->frames[n];
+		f->image = cvCreateImageHeader(cvSize(width, height),
+					       IPL_DEPTH_8U, channels);
+		if (!f->image) {
+			frame_pool_destroy(pool);
+			return -ENOMEM;
+		}
+		f->pool = pool;
+		f->format = format;
+		f->buffer = -1;
+		f->next = n + 1 < count ? n + 1 : -1;
+		pool->count++;
+	}
+	pool->free = 0;
+
+	return 0;
+}
+
+/* the frame shows the pixels of an external buffer until it is put */
+void frame_attach(struct frame *f, void *data, int step, int buffer)
+{
+	cvSetData(f->image, data, step);
+	f->buffer = buffer;
+}
+
+void frame_pool_destroy(struct frame_pool *pool)
+{
+	int n;
+
+	for (n = 0; n < pool->count; n++) {
+		if (pool->release)
+			cvReleaseImageHeader(&pool->frames[n].image);
+		else
+			cvReleaseImage(&pool->frames[n].image);
+	}
+
+	pool->count = 0;
+	pool->free = -1;
+	pthread_mutex_destroy(&pool->lock);
+}
+
+struct frame *frame_get(struct frame_pool *pool)
+{
+	struct frame *f = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->free < 0) {
+		/* every buffer is still referenced downstream */
+		pool->exhausted++;
+		goto done;
+	}
+
+	f = &pool->frames[pool->free];
+	pool->free = f->next;
+	f->seq = pool->seq++;
+	f->refs = 1;
+done:
+	pthread_mutex_unlock(&pool->lock);
+
+	return f;
+}
+
+void frame_hold(struct frame *f)
+{
+	__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+}
+
+void frame_put(struct frame *f)
+{
+	struct frame_pool *pool = f->pool;
+
+	if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	if (pool->release && f->buffer >= 0) {
+		pool->release(f);
+		f->buffer = -1;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	f->next = pool->free;
+	pool->free = f - pool->frames;
+	pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,71 @@
+#ifndef __FRAME_H_
+#define __FRAME_H_
+
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(HAVE_OPENCV2)
+#include "core/core_c.h"
+#else
+typedef void IplImage;
+#endif
+
+#define FRAME_POOL_MAX	16
+
+/* what the pixels of a frame are */
+enum frame_format {
+	FRAME_BGR = 0,
+	/* packed 4:2:2, the luma is every other byte */
+	FRAME_YUYV = 1,
+	FRAME_GREY = 2,
+};
+
+struct frame_pool;
+
+/* a pool buffer, shared by reference between the stages */
+struct frame {
+	IplImage *image;
+	struct frame_pool *pool;
+	unsigned long seq;
+	/* CLOCK_MONOTONIC ns when the frame was captured */
+	unsigned long long birth;
+	/* and when the sensor took it, per the driver; birth if unknown */
+	unsigned long long exposure;
+	enum frame_format format;
+	/* the driver buffer the pixels live in, -1 if the pool owns them */
+	int buffer;
+	int refs;
+	int next;
+};
+
+struct frame_pool {
+	struct frame frames[FRAME_POOL_MAX];
+	pthread_mutex_t lock;
+	unsigned long seq;
+	unsigned long exhausted;
+	/* external buffers: gives the pixels back once nobody uses them */
+	void (*release)(struct frame *f);
+	void *owner;
+	int count;
+	int free;
+};
+
+int frame_pool_init(struct frame_pool *pool, int count, int width, int height,
+		    int depth, int channels);
+int frame_pool_init_external(struct frame_pool *pool, int count, int width,
+			     int height, int channels, enum frame_format format,
+			     void (*release)(struct frame *f), void *owner);
+void frame_pool_destroy(struct frame_pool *pool);
+void frame_attach(struct frame *f, void *data, int step, int buffer);
+struct frame *frame_get(struct frame_pool *pool);
+void frame_hold(struct frame *f);
+void frame_put(struct frame *f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FRAME_H_ */
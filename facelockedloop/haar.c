@@ -0,0 +1,1123 @@
+/**
+ * @file facelockedloop/haar.c
+ * @brief Haar cascade evaluation, without the OpenCV object detector.
+ *
+ * Follows the OpenCV 2.4 cvHaarDetectObjects algorithm - features scaled
+ * over one integral image, windows stepped by max(2, scale), candidates
+ * grouped by similarity - so both produce the same boxes within rounding,
+ * which fll-cascade --compare checks on any set of images.
+ * Integral images and window evaluation use the compiler vector
+ * extensions, which map onto SSE2/AVX2 or NEON depending on the target;
+ * HAAR_LANES windows are evaluated side by side.
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "haar.h"
+
+#define HAAR_ALIGN		16
+#define HAAR_GROUP_EPS		0.2
+/* enough tasks for the stealing to even out the cost of the levels */
+#define HAAR_TASKS_PER_THREAD	8
+
+typedef int32_t haar_v4i __attribute__((vector_size(16)));
+typedef float haar_vf __attribute__((vector_size(HAAR_LANES * 4)));
+typedef int32_t haar_vi __attribute__((vector_size(HAAR_LANES * 4)));
+
+static
+uint32_t haar_align(uint32_t n)
+{
+	return (n + HAAR_ALIGN - 1) & ~(HAAR_ALIGN - 1);
+}
+
+struct haar_cascade *haar_cascade_alloc(int nstages, int nclassifiers,
+					int nnodes, int nalphas)
+{
+	struct haar_cascade *c;
+	uint32_t size;
+
+	size = haar_align(sizeof(*c));
+	size += haar_align(nstages * sizeof(struct haar_stage));
+	size += haar_align(nclassifiers * sizeof(struct haar_classifier));
+	size += haar_align(nnodes * sizeof(struct haar_node));
+	size += haar_align(nalphas * sizeof(float));
+
+	c = calloc(1, size);
+	if (!c)
+		return NULL;
+
+	c->magic = HAAR_MAGIC;
+	c->size = size;
+	c->nstages = nstages;
+	c->nclassifiers = nclassifiers;
+	c->nnodes = nnodes;
+	c->nalphas = nalphas;
+	c->stages = haar_align(sizeof(*c));
+	c->classifiers = c->stages +
+		haar_align(nstages * sizeof(struct haar_stage));
+	c->nodes = c->classifiers +
+		haar_align(nclassifiers * sizeof(struct haar_classifier));
+	c->alphas = c->nodes + haar_align(nnodes * sizeof(struct haar_node));
+
+	return c;
+}
+
+void haar_cascade_free(struct haar_cascade *c)
+{
+	free(c);
+}
+
+static
+int haar_table_check(uint32_t offset, int count, size_t elem, unsigned long size)
+{
+	if (count < 0 || offset % HAAR_ALIGN)
+		return -EINVAL;
+
+	if (offset > size || (unsigned long) count * elem > size - offset)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* everything the evaluator dereferences must stay within the blob */
+int haar_cascade_check(const struct haar_cascade *c, unsigned long size)
+{
+	const struct haar_classifier *cl;
+	const struct haar_stage *st;
+	const struct haar_node *n;
+	int i, j, k;
+
+	if (size < sizeof(*c) || c->magic != HAAR_MAGIC || c->size > size)
+		return -EINVAL;
+
+	if (c->width <= 2 || c->height <= 2 || c->nstages <= 0)
+		return -EINVAL;
+
+	if (haar_table_check(c->stages, c->nstages, sizeof(*st), size) ||
+	    haar_table_check(c->classifiers, c->nclassifiers, sizeof(*cl), size) ||
+	    haar_table_check(c->nodes, c->nnodes, sizeof(*n), size) ||
+	    haar_table_check(c->alphas, c->nalphas, sizeof(float), size))
+		return -EINVAL;
+
+	st = haar_stages(c);
+	cl = haar_classifiers(c);
+	n = haar_nodes(c);
+
+	for (i = 0; i < c->nstages; i++) {
+		if (st[i].classifier < 0 || st[i].count <= 0 ||
+		    st[i].classifier + st[i].count > c->nclassifiers)
+			return -EINVAL;
+	}
+
+	for (i = 0; i < c->nclassifiers; i++) {
+		if (cl[i].node < 0 || cl[i].count <= 0 ||
+		    cl[i].node + cl[i].count > c->nnodes ||
+		    cl[i].alpha < 0 || cl[i].alpha + cl[i].count + 1 > c->nalphas)
+			return -EINVAL;
+
+		for (j = cl[i].node; j < cl[i].node + cl[i].count; j++) {
+			if (n[j].left >= cl[i].count || -n[j].left > cl[i].count ||
+			    n[j].right >= cl[i].count || -n[j].right > cl[i].count)
+				return -EINVAL;
+
+			/* trees only point forward, a loop would never end */
+			k = j - cl[i].node;
+			if ((n[j].left > 0 && n[j].left <= k) ||
+			    (n[j].right > 0 && n[j].right <= k))
+				return -EINVAL;
+
+			if (n[j].nrects <= 0 || n[j].nrects > HAAR_MAX_RECTS)
+				return -EINVAL;
+
+			for (k = 0; k < n[j].nrects; k++) {
+				const struct haar_rect *r = &n[j].rect[k];
+
+				if (r->x < 0 || r->y < 0 || r->w <= 0 || r->h <= 0 ||
+				    r->x + r->w > c->width || r->y + r->h > c->height)
+					return -EINVAL;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * the blob is position independent, so the file is used as it is: the
+ * pages are shared read-only with every other detector mapping it.
+ */
+struct haar_cascade *haar_cascade_map(const char *path)
+{
+	struct haar_cascade *c;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || st.st_size < (off_t) sizeof(*c)) {
+		close(fd);
+		return NULL;
+	}
+
+	c = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (c == MAP_FAILED)
+		return NULL;
+
+	if (c->size != (unsigned long) st.st_size ||
+	    haar_cascade_check(c, st.st_size)) {
+		munmap(c, st.st_size);
+		return NULL;
+	}
+
+	madvise(c, c->size, MADV_WILLNEED);
+
+	return c;
+}
+
+void haar_cascade_unmap(struct haar_cascade *c)
+{
+	munmap(c, c->size);
+}
+
+int haar_cascade_save(const struct haar_cascade *c, const char *path)
+{
+	FILE *f;
+	int ret = 0;
+
+	f = fopen(path, "wb");
+	if (!f)
+		return -errno;
+
+	if (fwrite(c, 1, c->size, f) != c->size)
+		ret = -EIO;
+
+	if (fclose(f) && !ret)
+		ret = -EIO;
+
+	return ret;
+}
+
+#if defined(HAVE_OPENCV2)
+struct haar_cascade *haar_cascade_from_cv(const CvHaarClassifierCascade *cv)
+{
+	int nclassifiers = 0, nnodes = 0, nalphas = 0;
+	int i, j, k, r, ci = 0, ni = 0, ai = 0;
+	struct haar_classifier *cl;
+	struct haar_cascade *c;
+	struct haar_stage *st;
+	struct haar_node *n;
+	float *alpha;
+
+	for (i = 0; i < cv->count; i++) {
+		nclassifiers += cv->stage_classifier[i].count;
+		for (j = 0; j < cv->stage_classifier[i].count; j++) {
+			nnodes += cv->stage_classifier[i].classifier[j].count;
+			nalphas += cv->stage_classifier[i].classifier[j].count + 1;
+		}
+	}
+
+	c = haar_cascade_alloc(cv->count, nclassifiers, nnodes, nalphas);
+	if (!c)
+		return NULL;
+
+	c->width = cv->orig_window_size.width;
+	c->height = cv->orig_window_size.height;
+	st = (struct haar_stage *) haar_stages(c);
+	cl = (struct haar_classifier *) haar_classifiers(c);
+	n = (struct haar_node *) haar_nodes(c);
+	alpha = (float *) haar_alphas(c);
+
+	for (i = 0; i < cv->count; i++) {
+		const CvHaarStageClassifier *cvst = &cv->stage_classifier[i];
+
+		st[i].classifier = ci;
+		st[i].count = cvst->count;
+		st[i].threshold = cvst->threshold;
+
+		for (j = 0; j < cvst->count; j++, ci++) {
+			const CvHaarClassifier *cvcl = &cvst->classifier[j];
+
+			cl[ci].node = ni;
+			cl[ci].count = cvcl->count;
+			cl[ci].alpha = ai;
+
+			for (k = 0; k < cvcl->count; k++, ni++) {
+				const CvHaarFeature *f = &cvcl->haar_feature[k];
+
+				/* tilted features are not supported */
+				if (f->tilted)
+					goto fail;
+
+				for (r = 0; r < HAAR_MAX_RECTS; r++) {
+					if (!f->rect[r].r.width)
+						break;
+					n[ni].rect[r].x = f->rect[r].r.x;
+					n[ni].rect[r].y = f->rect[r].r.y;
+					n[ni].rect[r].w = f->rect[r].r.width;
+					n[ni].rect[r].h = f->rect[r].r.height;
+					n[ni].rect[r].weight = f->rect[r].weight;
+				}
+				n[ni].nrects = r;
+				n[ni].threshold = cvcl->threshold[k];
+				n[ni].left = cvcl->left[k];
+				n[ni].right = cvcl->right[k];
+			}
+
+			for (k = 0; k <= cvcl->count; k++)
+				alpha[ai++] = cvcl->alpha[k];
+		}
+	}
+
+	if (haar_cascade_check(c, c->size))
+		goto fail;
+
+	return c;
+fail:
+	haar_cascade_free(c);
+	return NULL;
+}
+#endif
+
+int haar_detector_init(struct haar_detector *hd, const struct haar_cascade *c)
+{
+	memset(hd, 0, sizeof(*hd));
+	hd->cascade = c;
+
+	hd->cands = calloc(HAAR_MAX_CANDIDATES, sizeof(*hd->cands));
+	hd->labels = calloc(HAAR_MAX_CANDIDATES, sizeof(*hd->labels));
+	if (!hd->cands || !hd->labels) {
+		haar_detector_destroy(hd);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static
+void haar_scales_release(struct haar_detector *hd)
+{
+	int k;
+
+	for (k = 0; k < HAAR_MAX_SCALES; k++) {
+		free(hd->scales[k].nodes);
+		hd->scales[k].nodes = NULL;
+		hd->scales[k].factor = 0;
+	}
+}
+
+static
+void haar_pool_release(struct haar_pool *pool)
+{
+	int i;
+
+	pool->quit = 1;
+	for (i = 1; i < pool->nthreads; i++) {
+		sem_post(&pool->workers[i].go);
+		pthread_join(pool->workers[i].thread, NULL);
+	}
+
+	for (i = 0; i < pool->nthreads; i++) {
+		sem_destroy(&pool->workers[i].go);
+		free(pool->workers[i].sink.box);
+	}
+
+	sem_destroy(&pool->done);
+	free(pool);
+}
+
+void haar_detector_destroy(struct haar_detector *hd)
+{
+	if (hd->pool)
+		haar_pool_release(hd->pool);
+	haar_scales_release(hd);
+	free(hd->sum);
+	free(hd->sqsum);
+	free(hd->cands);
+	free(hd->labels);
+	memset(hd, 0, sizeof(*hd));
+}
+
+/* integral images are only reallocated when the frame grows */
+static
+int haar_reserve(struct haar_detector *hd, int width, int height)
+{
+	if (width + 1 <= hd->stride && height + 1 <= hd->rows)
+		return 0;
+
+	free(hd->sum);
+	free(hd->sqsum);
+	haar_scales_release(hd);
+
+	hd->stride = width + 1;
+	hd->rows = height + 1;
+	hd->sum = malloc(hd->stride * hd->rows * sizeof(*hd->sum));
+	hd->sqsum = malloc(hd->stride * hd->rows * sizeof(*hd->sqsum));
+	if (!hd->sum || !hd->sqsum) {
+		free(hd->sum);
+		free(hd->sqsum);
+		hd->sum = NULL;
+		hd->sqsum = NULL;
+		hd->stride = hd->rows = 0;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static inline
+haar_v4i haar_v4i_load(const int32_t *p)
+{
+	haar_v4i v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/*
+ * each row: in-register prefix sum of four pixels at a time (two shifted
+ * adds plus the carry of the previous block), added to the row above.
+ */
+void haar_integral(const unsigned char *img, int width, int height, int step,
+		   int32_t *sum, int64_t *sqsum, int stride)
+{
+	const haar_v4i zero = { 0, 0, 0, 0 };
+	const haar_v4i shift1 = { 0, 4, 5, 6 };
+	const haar_v4i shift2 = { 0, 1, 4, 5 };
+	haar_v4i v, q, carry, qcarry;
+	int32_t *srow, *sprev;
+	int64_t *qrow, *qprev;
+	const unsigned char *src;
+	int32_t rs, rq;
+	int x, y, l;
+
+	memset(sum, 0, (width + 1) * sizeof(*sum));
+	memset(sqsum, 0, (width + 1) * sizeof(*sqsum));
+
+	for (y = 0; y < height; y++) {
+		src = img + y * step;
+		sprev = sum + y * stride;
+		srow = sprev + stride;
+		qprev = sqsum + y * stride;
+		qrow = qprev + stride;
+		srow[0] = 0;
+		qrow[0] = 0;
+		carry = zero;
+		qcarry = zero;
+
+		for (x = 0; x + 4 <= width; x += 4) {
+			v = (haar_v4i) { src[x], src[x + 1], src[x + 2], src[x + 3] };
+			q = v * v;
+
+			v += __builtin_shuffle(zero, v, shift1);
+			v += __builtin_shuffle(zero, v, shift2);
+			q += __builtin_shuffle(zero, q, shift1);
+			q += __builtin_shuffle(zero, q, shift2);
+			v += carry;
+			q += qcarry;
+			carry = zero + v[3];
+			qcarry = zero + q[3];
+
+			v += haar_v4i_load(sprev + 1 + x);
+			memcpy(srow + 1 + x, &v, sizeof(v));
+			for (l = 0; l < 4; l++)
+				qrow[1 + x + l] = qprev[1 + x + l] + q[l];
+		}
+
+		rs = carry[0];
+		rq = qcarry[0];
+		for (; x < width; x++) {
+			rs += src[x];
+			rq += src[x] * src[x];
+			srow[1 + x] = sprev[1 + x] + rs;
+			qrow[1 + x] = qprev[1 + x] + rq;
+		}
+	}
+}
+
+static inline
+void haar_corners(int32_t *p, int x, int y, int w, int h, int stride)
+{
+	p[0] = y * stride + x;
+	p[1] = y * stride + x + w;
+	p[2] = (y + h) * stride + x;
+	p[3] = (y + h) * stride + x + w;
+}
+
+/*
+ * lay the cascade out for one window size: the same scaling and weight
+ * correction as cvSetImagesForHaarClassifierCascade.
+ */
+static
+struct haar_scale *haar_scale_setup(struct haar_detector *hd, int k,
+				    double factor)
+{
+	const struct haar_cascade *c = hd->cascade;
+	const struct haar_node *n = haar_nodes(c);
+	struct haar_scale *sc = &hd->scales[k];
+	struct haar_snode *sn;
+	double sum0, area0;
+	int i, r, ex, ew, eh;
+	int x, y, w, h;
+
+	if (sc->nodes && sc->factor == factor)
+		return sc;
+
+	if (!sc->nodes) {
+		sc->nodes = malloc(c->nnodes * sizeof(*sc->nodes));
+		if (!sc->nodes)
+			return NULL;
+	}
+
+	sc->factor = factor;
+	sc->winw = lrint(c->width * factor);
+	sc->winh = lrint(c->height * factor);
+
+	ex = lrint(factor);
+	ew = lrint((c->width - 2) * factor);
+	eh = lrint((c->height - 2) * factor);
+	sc->inv_area = 1.0 / (ew * eh);
+	haar_corners(sc->p, ex, ex, ew, eh, hd->stride);
+
+	for (i = 0; i < c->nnodes; i++) {
+		sn = &sc->nodes[i];
+		sum0 = 0;
+		area0 = 1;
+
+		for (r = 0; r < n[i].nrects; r++) {
+			x = lrint(n[i].rect[r].x * factor);
+			y = lrint(n[i].rect[r].y * factor);
+			w = lrint(n[i].rect[r].w * factor);
+			h = lrint(n[i].rect[r].h * factor);
+			haar_corners(sn->p[r], x, y, w, h, hd->stride);
+			sn->weight[r] = n[i].rect[r].weight * sc->inv_area;
+
+			if (!r)
+				area0 = w * h;
+			else
+				sum0 += sn->weight[r] * w * h;
+		}
+		/* a flat window must sum to zero whatever the rounding */
+		sn->weight[0] = -sum0 / area0;
+		sn->nrects = n[i].nrects;
+		sn->threshold = n[i].threshold;
+		sn->left = n[i].left;
+		sn->right = n[i].right;
+	}
+
+	return sc;
+}
+
+static inline
+int32_t haar_rsum(const int32_t *s, const int32_t *p)
+{
+	return s[p[0]] - s[p[1]] - s[p[2]] + s[p[3]];
+}
+
+static inline
+float haar_norm(const struct haar_detector *hd, const struct haar_scale *sc,
+		int off)
+{
+	const int64_t *q = hd->sqsum + off;
+	double mean, var;
+
+	mean = haar_rsum(hd->sum + off, sc->p) * sc->inv_area;
+	var = (q[sc->p[0]] - q[sc->p[1]] - q[sc->p[2]] + q[sc->p[3]]) *
+		sc->inv_area - mean * mean;
+
+	return var >= 0 ? sqrt(var) : 1;
+}
+
+static inline
+float haar_tree(const struct haar_detector *hd, const struct haar_scale *sc,
+		const struct haar_classifier *cl, int off, float nf)
+{
+	const struct haar_snode *sn;
+	const int32_t *s = hd->sum + off;
+	int idx = 0, r;
+	float val;
+
+	do {
+		sn = &sc->nodes[cl->node + idx];
+		val = 0;
+		for (r = 0; r < sn->nrects; r++)
+			val += haar_rsum(s, sn->p[r]) * sn->weight[r];
+		idx = val < sn->threshold * nf ? sn->left : sn->right;
+	} while (idx > 0);
+
+	return haar_alphas(hd->cascade)[cl->alpha - idx];
+}
+
+/* 1 when the window at off passes every stage, -stage it failed at if not */
+static
+int haar_eval(const struct haar_detector *hd, const struct haar_scale *sc,
+	      int off)
+{
+	const struct haar_cascade *c = hd->cascade;
+	const struct haar_classifier *cl = haar_classifiers(c);
+	const struct haar_stage *st = haar_stages(c);
+	float nf, stage_sum;
+	int i, j;
+
+	nf = haar_norm(hd, sc, off);
+
+	for (i = 0; i < c->nstages; i++) {
+		stage_sum = 0;
+		for (j = st[i].classifier; j < st[i].classifier + st[i].count; j++)
+			stage_sum += haar_tree(hd, sc, &cl[j], off, nf);
+
+		if (stage_sum < st[i].threshold)
+			return -i;
+	}
+
+	return 1;
+}
+
+static inline
+haar_vi haar_gather(const int32_t *s, const int *off, int32_t p)
+{
+	haar_vi v;
+	int l;
+
+	for (l = 0; l < HAAR_LANES; l++)
+		v[l] = s[off[l] + p];
+
+	return v;
+}
+
+/* haar_eval() on HAAR_LANES windows at once; stumps run in the lanes */
+static
+void haar_eval_lanes(const struct haar_detector *hd,
+		     const struct haar_scale *sc, const int *off, int *result)
+{
+	const struct haar_cascade *c = hd->cascade;
+	const struct haar_classifier *cl = haar_classifiers(c);
+	const struct haar_stage *st = haar_stages(c);
+	const float *alpha = haar_alphas(c);
+	const struct haar_snode *sn;
+	haar_vf nf, val, stage_sum, a0, a1;
+	haar_vi alive, pass, rs, lt;
+	int i, j, l, r, any;
+
+	for (l = 0; l < HAAR_LANES; l++) {
+		nf[l] = haar_norm(hd, sc, off[l]);
+		alive[l] = -1;
+		result[l] = 1;
+	}
+
+	for (i = 0; i < c->nstages; i++) {
+		stage_sum = (haar_vf) {};
+
+		for (j = st[i].classifier; j < st[i].classifier + st[i].count; j++) {
+			if (cl[j].count > 1) {
+				for (l = 0; l < HAAR_LANES; l++)
+					stage_sum[l] += haar_tree(hd, sc, &cl[j],
+								  off[l], nf[l]);
+				continue;
+			}
+
+			sn = &sc->nodes[cl[j].node];
+			val = (haar_vf) {};
+			for (r = 0; r < sn->nrects; r++) {
+				rs = haar_gather(hd->sum, off, sn->p[r][0]) -
+				     haar_gather(hd->sum, off, sn->p[r][1]) -
+				     haar_gather(hd->sum, off, sn->p[r][2]) +
+				     haar_gather(hd->sum, off, sn->p[r][3]);
+				val += __builtin_convertvector(rs, haar_vf) *
+					sn->weight[r];
+			}
+
+			lt = val < sn->threshold * nf;
+			a0 = (haar_vf) {} + alpha[cl[j].alpha - sn->left];
+			a1 = (haar_vf) {} + alpha[cl[j].alpha - sn->right];
+			stage_sum += (haar_vf) (((haar_vi) a0 & lt) |
+						((haar_vi) a1 & ~lt));
+		}
+
+		pass = stage_sum >= st[i].threshold;
+		any = 0;
+		for (l = 0; l < HAAR_LANES; l++) {
+			if (alive[l] && !pass[l])
+				result[l] = -i;
+			any |= alive[l] & pass[l];
+		}
+		if (!any)
+			return;
+		alive &= pass;
+	}
+}
+
+static inline
+void haar_candidate(struct haar_sink *sink, const struct haar_scale *sc,
+		    int x, int y)
+{
+	struct haar_box *b;
+
+	if (sink->count >= HAAR_MAX_CANDIDATES) {
+		sink->overflows++;
+		return;
+	}
+
+	b = &sink->box[sink->count++];
+	b->x = x;
+	b->y = y;
+	b->width = sc->winw;
+	b->height = sc->winh;
+	b->neighbors = 0;
+}
+
+static inline
+double haar_step(const struct haar_scale *sc)
+{
+	return sc->factor > 2 ? sc->factor : 2;
+}
+
+/* window rows or columns of a level over a frame dimension */
+static inline
+int haar_windows(const struct haar_scale *sc, int len, int win)
+{
+	return lrint((len - win) / haar_step(sc));
+}
+
+/*
+ * As in OpenCV, a window failing the first stage moves the scan on by two
+ * columns, any other by one. The lanes take the next windows two columns
+ * apart, which is that path for as long as they all fail it; from the first
+ * one that does not, windows go one at a time until one fails it again.
+ * Only window rows [y0, y1) are scanned.
+ */
+static
+void haar_scan(const struct haar_detector *hd, const struct haar_scale *sc,
+	       int width, int y0, int y1, struct haar_sink *sink)
+{
+	int off[HAAR_LANES], result[HAAR_LANES];
+	int ix, iy, x, y, l, endx, last, ret;
+	double ystep;
+
+	ystep = haar_step(sc);
+	endx = haar_windows(sc, width, sc->winw);
+
+	for (iy = y0; iy < y1; iy++) {
+		y = lrint(iy * ystep);
+		ix = 0;
+
+		while (ix < endx) {
+			for (l = 0, last = ix; l < HAAR_LANES; l++) {
+				/* pad the row end with the last real column */
+				if (ix + 2 * l < endx)
+					last = ix + 2 * l;
+				off[l] = y * hd->stride + lrint(last * ystep);
+			}
+
+			haar_eval_lanes(hd, sc, off, result);
+
+			for (l = 0; l < HAAR_LANES && ix < endx; l++) {
+				if (result[l] > 0)
+					haar_candidate(sink, sc, lrint(ix * ystep), y);
+				if (result[l])
+					break;
+				ix += 2;
+			}
+			if (l == HAAR_LANES || ix >= endx)
+				continue;
+
+			/* past the first stage: the next column is looked at too */
+			do {
+				if (++ix >= endx)
+					break;
+				x = lrint(ix * ystep);
+				ret = haar_eval(hd, sc, y * hd->stride + x);
+				if (ret > 0)
+					haar_candidate(sink, sc, x, y);
+			} while (ret);
+			ix += 2;
+		}
+	}
+}
+
+static
+void haar_work(struct haar_pool *pool, struct haar_worker *w)
+{
+	const struct haar_detector *hd = pool->hd;
+	const struct haar_task *t;
+	struct haar_worker *victim;
+	int i, n, me;
+
+	w->sink.count = 0;
+	me = w - pool->workers;
+
+	/* own range first, then everybody else's */
+	for (i = 0; i < pool->nthreads; i++) {
+		victim = &pool->workers[(me + i) % pool->nthreads];
+
+		for (;;) {
+			n = __atomic_fetch_add(&victim->next, 1, __ATOMIC_RELAXED);
+			if (n >= victim->end)
+				break;
+
+			t = &pool->tasks[n];
+			haar_scan(hd, &hd->scales[t->scale], pool->width,
+				  t->y0, t->y1, &w->sink);
+			w->tasks++;
+			if (i)
+				w->stolen++;
+		}
+	}
+}
+
+static
+void *haar_worker_thread(void *arg)
+{
+	struct haar_worker *w = arg;
+	struct haar_pool *pool = w->pool;
+
+	for (;;) {
+		sem_wait(&w->go);
+		if (pool->quit)
+			break;
+
+		haar_work(pool, w);
+		sem_post(&pool->done);
+	}
+
+	return NULL;
+}
+
+int haar_detector_threads(struct haar_detector *hd, int nthreads)
+{
+	struct haar_pool *pool;
+	struct haar_worker *w;
+	int i;
+
+	if (nthreads < 1 || nthreads > HAAR_MAX_THREADS)
+		return -EINVAL;
+
+	if (hd->pool) {
+		haar_pool_release(hd->pool);
+		hd->pool = NULL;
+	}
+
+	if (nthreads == 1)
+		return 0;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return -ENOMEM;
+
+	pool->hd = hd;
+	sem_init(&pool->done, 0, 0);
+
+	for (i = 0; i < nthreads; i++) {
+		w = &pool->workers[i];
+		w->pool = pool;
+		w->sink.box = calloc(HAAR_MAX_CANDIDATES, sizeof(*w->sink.box));
+		if (!w->sink.box)
+			goto error;
+
+		sem_init(&w->go, 0, 0);
+		/* the calling thread is worker zero */
+		if (i && pthread_create(&w->thread, NULL, haar_worker_thread, w)) {
+			sem_destroy(&w->go);
+			free(w->sink.box);
+			w->sink.box = NULL;
+			goto error;
+		}
+		pool->nthreads++;
+	}
+
+	hd->pool = pool;
+
+	return 0;
+error:
+	haar_pool_release(pool);
+
+	return -ENOMEM;
+}
+
+/*
+ * cut every level into bands of rows holding about the same number of
+ * windows; the grain doubles until the task list fits.
+ */
+static
+void haar_pool_split(struct haar_pool *pool, struct haar_scale **levels,
+		     int nlevels, int width, int height)
+{
+	struct haar_scale *sc;
+	long total, grain;
+	int i, y, rows, cols, band;
+
+	for (i = 0, total = 0; i < nlevels; i++)
+		total += (long) haar_windows(levels[i], width, levels[i]->winw) *
+			haar_windows(levels[i], height, levels[i]->winh);
+
+	grain = total / (pool->nthreads * HAAR_TASKS_PER_THREAD) + 1;
+again:
+	pool->ntasks = 0;
+	for (i = 0; i < nlevels; i++) {
+		sc = levels[i];
+		cols = haar_windows(sc, width, sc->winw);
+		rows = haar_windows(sc, height, sc->winh);
+		band = cols > 0 && grain / cols > 1 ? grain / cols : 1;
+
+		for (y = 0; y < rows; y += band) {
+			if (pool->ntasks == HAAR_MAX_TASKS) {
+				grain *= 2;
+				goto again;
+			}
+
+			pool->tasks[pool->ntasks].scale = sc - pool->hd->scales;
+			pool->tasks[pool->ntasks].y0 = y;
+			pool->tasks[pool->ntasks].y1 = y + band < rows ? y + band : rows;
+			pool->ntasks++;
+		}
+	}
+}
+
+static
+void haar_pool_run(struct haar_pool *pool, struct haar_scale **levels,
+		   int nlevels, int width, int height)
+{
+	struct haar_detector *hd = pool->hd;
+	struct haar_worker *w;
+	int i, n;
+
+	haar_pool_split(pool, levels, nlevels, width, height);
+	pool->width = width;
+
+	for (i = 0; i < pool->nthreads; i++) {
+		w = &pool->workers[i];
+		w->next = i * pool->ntasks / pool->nthreads;
+		w->end = (i + 1) * pool->ntasks / pool->nthreads;
+	}
+
+	for (i = 1; i < pool->nthreads; i++)
+		sem_post(&pool->workers[i].go);
+
+	haar_work(pool, &pool->workers[0]);
+
+	for (i = 1; i < pool->nthreads; i++)
+		sem_wait(&pool->done);
+
+	/* grouping does not care where the candidates came from */
+	hd->ncands = 0;
+	for (i = 0; i < pool->nthreads; i++) {
+		w = &pool->workers[i];
+		n = w->sink.count;
+		if (n > HAAR_MAX_CANDIDATES - hd->ncands) {
+			hd->overflows += n - (HAAR_MAX_CANDIDATES - hd->ncands);
+			n = HAAR_MAX_CANDIDATES - hd->ncands;
+		}
+
+		memcpy(&hd->cands[hd->ncands], w->sink.box, n * sizeof(*w->sink.box));
+		hd->ncands += n;
+		hd->overflows += w->sink.overflows;
+		w->sink.overflows = 0;
+	}
+}
+
+static inline
+int haar_similar(const struct haar_box *a, const struct haar_box *b)
+{
+	double delta;
+
+	delta = HAAR_GROUP_EPS * ((a->width < b->width ? a->width : b->width) +
+				  (a->height < b->height ? a->height : b->height)) * 0.5;
+
+	return abs(a->x - b->x) <= delta && abs(a->y - b->y) <= delta &&
+		abs(a->x + a->width - b->x - b->width) <= delta &&
+		abs(a->y + a->height - b->y - b->height) <= delta;
+}
+
+static inline
+int haar_root(int *labels, int i)
+{
+	while (labels[i] != i) {
+		labels[i] = labels[labels[i]];
+		i = labels[i];
+	}
+
+	return i;
+}
+
+/*
+ * cluster similar candidates, average every cluster and keep those with
+ * more than min_neighbors members that are not nested in a stronger one:
+ * OpenCV groupRectangles(). The groups are returned at the front of cands.
+ */
+int haar_group(struct haar_box *cands, int *labels, int n, int min_neighbors)
+{
+	int i, j, a, b, id, ngroups = 0, nout = 0;
+	struct haar_box *g, *r1, *r2;
+	int dx, dy;
+	double s;
+
+	for (i = 0; i < n; i++)
+		labels[i] = i;
+
+	/* roots always have the lowest index of their cluster */
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < i; j++) {
+			if (!haar_similar(&cands[i], &cands[j]))
+				continue;
+			a = haar_root(labels, i);
+			b = haar_root(labels, j);
+			if (a != b)
+				labels[a > b ? a : b] = a > b ? b : a;
+		}
+	}
+
+	/*
+	 * roots come before their members: number the clusters, leaving the
+	 * id encoded as a negative label on the root, and accumulate in place
+	 * at the front of cands - a cluster id never exceeds its root index.
+	 */
+	for (i = 0; i < n; i++) {
+		if (labels[i] == i) {
+			id = ngroups++;
+			labels[i] = -(id + 1);
+			g = &cands[id];
+			a = cands[i].x;
+			b = cands[i].y;
+			dx = cands[i].width;
+			dy = cands[i].height;
+			g->x = a;
+			g->y = b;
+			g->width = dx;
+			g->height = dy;
+			g->neighbors = 1;
+			continue;
+		}
+
+		/* path from i to the root only goes through lower indices */
+		a = labels[i];
+		while (labels[a] >= 0)
+			a = labels[a];
+		id = -labels[a] - 1;
+		labels[i] = a;
+
+		g = &cands[id];
+		g->x += cands[i].x;
+		g->y += cands[i].y;
+		g->width += cands[i].width;
+		g->height += cands[i].height;
+		g->neighbors++;
+	}
+
+	for (i = 0; i < ngroups; i++) {
+		g = &cands[i];
+		s = 1.0 / g->neighbors;
+		g->x = lrint(g->x * s);
+		g->y = lrint(g->y * s);
+		g->width = lrint(g->width * s);
+		g->height = lrint(g->height * s);
+	}
+
+	for (i = 0; i < ngroups; i++) {
+		r1 = &cands[i];
+		if (r1->neighbors <= min_neighbors)
+			continue;
+
+		/* drop small boxes inside bigger, better supported ones */
+		for (j = 0; j < ngroups; j++) {
+			r2 = &cands[j];
+			if (j == i || r2->neighbors <= min_neighbors)
+				continue;
+
+			dx = lrint(r2->width * HAAR_GROUP_EPS);
+			dy = lrint(r2->height * HAAR_GROUP_EPS);
+			if (r1->x >= r2->x - dx && r1->y >= r2->y - dy &&
+			    r1->x + r1->width <= r2->x + r2->width + dx &&
+			    r1->y + r1->height <= r2->y + r2->height + dy &&
+			    (r2->neighbors > (r1->neighbors > 3 ? r1->neighbors : 3) ||
+			     r1->neighbors < 3))
+				break;
+		}
+
+		if (j == ngroups)
+			labels[nout++] = i;
+	}
+
+	for (i = 0; i < nout; i++)
+		cands[i] = cands[labels[i]];
+
+	return nout;
+}
+
+int haar_detect(struct haar_detector *hd, const unsigned char *img,
+		int width, int height, int step,
+		const struct haar_params *p, struct haar_box *out, int maxout)
+{
+	struct haar_scale *levels[HAAR_MAX_SCALES];
+	const struct haar_cascade *c = hd->cascade;
+	struct haar_sink sink;
+	int i, k, n, best, nlevels;
+	double factor;
+
+	if (haar_reserve(hd, width, height))
+		return -ENOMEM;
+
+	haar_integral(img, width, height, step, hd->sum, hd->sqsum, hd->stride);
+
+	/* scales are laid out up front, the scan only reads them */
+	for (k = 0, nlevels = 0, factor = 1;
+	     k < HAAR_MAX_SCALES && factor * c->width < width - 10 &&
+		     factor * c->height < height - 10;
+	     k++, factor *= p->scale_factor) {
+
+		if (lrint(c->width * factor) < p->min_size ||
+		    lrint(c->height * factor) < p->min_size)
+			continue;
+
+		if (p->max_size && (lrint(c->width * factor) > p->max_size ||
+				    lrint(c->height * factor) > p->max_size))
+			break;
+
+		levels[nlevels] = haar_scale_setup(hd, k, factor);
+		if (!levels[nlevels])
+			return -ENOMEM;
+		nlevels++;
+	}
+
+	if (hd->pool) {
+		haar_pool_run(hd->pool, levels, nlevels, width, height);
+	} else {
+		sink.box = hd->cands;
+		sink.count = 0;
+		sink.overflows = 0;
+		for (i = 0; i < nlevels; i++)
+			haar_scan(hd, levels[i], width, 0,
+				  haar_windows(levels[i], height, levels[i]->winh),
+				  &sink);
+		hd->ncands = sink.count;
+		hd->overflows += sink.overflows;
+	}
+
+	n = haar_group(hd->cands, hd->labels, hd->ncands, p->min_neighbors);
+
+	if (p->biggest && n > 1) {
+		for (i = 1, best = 0; i < n; i++) {
+			if (hd->cands[i].width * hd->cands[i].height >
+			    hd->cands[best].width * hd->cands[best].height)
+				best = i;
+		}
+		hd->cands[0] = hd->cands[best];
+		n = 1;
+	}
+
+	if (n > maxout)
+		n = maxout;
+	memcpy(out, hd->cands, n * sizeof(*out));
+
+	return n;
+}
@@ -0,0 +1,221 @@
+#ifndef __HAAR_H_
+#define __HAAR_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#if defined(HAVE_OPENCV2)
+#include "objdetect/objdetect.hpp"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HAAR_MAGIC		0x31434846	/* "FHC1" */
+#define HAAR_MAX_RECTS		3
+#define HAAR_MAX_SCALES		32
+#define HAAR_MAX_CANDIDATES	4096
+#define HAAR_MAX_THREADS	8
+#define HAAR_MAX_TASKS		512
+
+#if defined(__AVX2__)
+#define HAAR_LANES		8
+#else
+#define HAAR_LANES		4
+#endif
+
+/*
+ * The cascade is a single position independent blob: a header followed by
+ * the stage, classifier, node and alpha tables, referenced by byte offset
+ * from the start of the header.
+ */
+struct haar_rect {
+	int32_t x;
+	int32_t y;
+	int32_t w;
+	int32_t h;
+	float weight;
+};
+
+struct haar_node {
+	struct haar_rect rect[HAAR_MAX_RECTS];
+	int32_t nrects;
+	float threshold;
+	/* > 0: next node, <= 0: leaf, index into the classifier alphas */
+	int32_t left;
+	int32_t right;
+};
+
+struct haar_classifier {
+	int32_t node;
+	int32_t count;
+	int32_t alpha;
+	int32_t pad;
+};
+
+struct haar_stage {
+	int32_t classifier;
+	int32_t count;
+	float threshold;
+	int32_t pad;
+};
+
+struct haar_cascade {
+	uint32_t magic;
+	uint32_t size;
+	int32_t width;
+	int32_t height;
+	int32_t nstages;
+	int32_t nclassifiers;
+	int32_t nnodes;
+	int32_t nalphas;
+	uint32_t stages;
+	uint32_t classifiers;
+	uint32_t nodes;
+	uint32_t alphas;
+};
+
+static inline
+const struct haar_stage *haar_stages(const struct haar_cascade *c)
+{
+	return (const struct haar_stage *)((const char *)c + c->stages);
+}
+
+static inline
+const struct haar_classifier *haar_classifiers(const struct haar_cascade *c)
+{
+	return (const struct haar_classifier *)((const char *)c + c->classifiers);
+}
+
+static inline
+const struct haar_node *haar_nodes(const struct haar_cascade *c)
+{
+	return (const struct haar_node *)((const char *)c + c->nodes);
+}
+
+static inline
+const float *haar_alphas(const struct haar_cascade *c)
+{
+	return (const float *)((const char *)c + c->alphas);
+}
+
+struct haar_box {
+	int x;
+	int y;
+	int width;
+	int height;
+	int neighbors;
+};
+
+struct haar_params {
+	double scale_factor;
+	int min_neighbors;
+	int min_size;
+	int max_size;
+	int biggest;
+};
+
+/* a node laid out for one window size over the integral image */
+struct haar_snode {
+	int32_t p[HAAR_MAX_RECTS][4];
+	float weight[HAAR_MAX_RECTS];
+	float threshold;
+	int32_t nrects;
+	int32_t left;
+	int32_t right;
+};
+
+struct haar_scale {
+	struct haar_snode *nodes;
+	double factor;
+	int winw;
+	int winh;
+	int32_t p[4];
+	double inv_area;
+};
+
+/* where a scan leaves its candidate windows */
+struct haar_sink {
+	struct haar_box *box;
+	int count;
+	unsigned long overflows;
+};
+
+/* a band of window rows, [y0, y1), of one pyramid level */
+struct haar_task {
+	int scale;
+	int y0;
+	int y1;
+};
+
+/*
+ * every worker owns a contiguous range of the task list and takes from it
+ * with an atomic increment; once it runs dry it steals from the ranges of
+ * the others the same way.
+ */
+struct haar_worker {
+	int next;
+	int end;
+	struct haar_pool *pool;
+	struct haar_sink sink;
+	pthread_t thread;
+	sem_t go;
+	unsigned long tasks;
+	unsigned long stolen;
+} __attribute__((aligned(64)));
+
+struct haar_pool {
+	struct haar_worker workers[HAAR_MAX_THREADS];
+	struct haar_task tasks[HAAR_MAX_TASKS];
+	struct haar_detector *hd;
+	sem_t done;
+	int nthreads;
+	int ntasks;
+	int width;
+	int quit;
+};
+
+struct haar_detector {
+	const struct haar_cascade *cascade;
+	int32_t *sum;
+	int64_t *sqsum;
+	int stride;
+	int rows;
+	struct haar_scale scales[HAAR_MAX_SCALES];
+	struct haar_box *cands;
+	int *labels;
+	int ncands;
+	unsigned long overflows;
+	struct haar_pool *pool;
+};
+
+struct haar_cascade *haar_cascade_alloc(int nstages, int nclassifiers,
+					int nnodes, int nalphas);
+void haar_cascade_free(struct haar_cascade *c);
+int haar_cascade_check(const struct haar_cascade *c, unsigned long size);
+struct haar_cascade *haar_cascade_map(const char *path);
+void haar_cascade_unmap(struct haar_cascade *c);
+int haar_cascade_save(const struct haar_cascade *c, const char *path);
+
+int haar_detector_init(struct haar_detector *hd, const struct haar_cascade *c);
+void haar_detector_destroy(struct haar_detector *hd);
+int haar_detector_threads(struct haar_detector *hd, int nthreads);
+int haar_detect(struct haar_detector *hd, const unsigned char *img,
+		int width, int height, int step,
+		const struct haar_params *p, struct haar_box *out, int maxout);
+
+void haar_integral(const unsigned char *img, int width, int height, int step,
+		   int32_t *sum, int64_t *sqsum, int stride);
+int haar_group(struct haar_box *cands, int *labels, int n, int min_neighbors);
+
+#if defined(HAVE_OPENCV2)
+struct haar_cascade *haar_cascade_from_cv(const CvHaarClassifierCascade *cv);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HAAR_H_ */
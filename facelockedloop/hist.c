@@ -0,0 +1,106 @@
+/**
+ * @file facelockedloop/hist.c
+ * @brief Latency histograms for the pipeline statistics.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "time_utils.h"
+#include "hist.h"
+
+static inline
+int hist_index(uint64_t v)
+{
+	int e;
+
+	if (v < HIST_SUB)
+		return v;
+
+	if (v >> HIST_MAX_BITS)
+		v = (1ULL << HIST_MAX_BITS) - 1;
+
+	e = 63 - __builtin_clzll(v);
+
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB +
+		((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* the middle of the range a bucket covers */
+static inline
+uint64_t hist_value(int idx)
+{
+	int e;
+
+	if (idx < HIST_SUB)
+		return idx;
+
+	e = idx / HIST_SUB + HIST_SUB_BITS - 1;
+
+	return ((uint64_t) (HIST_SUB + idx % HIST_SUB) << (e - HIST_SUB_BITS)) +
+		((1ULL << (e - HIST_SUB_BITS)) >> 1);
+}
+
+static inline
+void hist_bump(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+void hist_reset(struct hist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+void hist_record(struct hist *h, uint64_t value)
+{
+	hist_bump(&h->buckets[hist_index(value)], 1);
+	hist_bump(&h->sum, value);
+	if (value > h->max)
+		__atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t hist_percentile(const struct hist *h, double percentile)
+{
+	uint64_t count, target, seen = 0;
+	int i;
+
+	count = __atomic_load_n(&h->count, __ATOMIC_ACQUIRE);
+	if (!count)
+		return 0;
+
+	target = percentile * count / 100;
+	if (target < 1)
+		target = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+		if (seen >= target)
+			return hist_value(i);
+	}
+
+	return __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+static inline
+double hist_msecs(uint64_t ns)
+{
+	return (double) ns / FLL_NANOSECONDS_IN_MILISECOND;
+}
+
+void hist_print(const struct hist *h, const char *name)
+{
+	uint64_t count = __atomic_load_n(&h->count, __ATOMIC_ACQUIRE);
+
+	if (!count)
+		return;
+
+	printf("    %-8s ms: p50 %8.3f  p90 %8.3f  p99 %8.3f  max %8.3f  "
+	       "avg %8.3f (%llu)\n", name,
+	       hist_msecs(hist_percentile(h, 50)),
+	       hist_msecs(hist_percentile(h, 90)),
+	       hist_msecs(hist_percentile(h, 99)),
+	       hist_msecs(__atomic_load_n(&h->max, __ATOMIC_RELAXED)),
+	       hist_msecs(__atomic_load_n(&h->sum, __ATOMIC_RELAXED)) / count,
+	       (unsigned long long) count);
+}
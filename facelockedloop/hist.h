@@ -0,0 +1,38 @@
+#ifndef __HIST_H_
+#define __HIST_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * log-linear histogram: values below 2^HIST_SUB_BITS have a bucket each,
+ * above that every power of two is split in 2^HIST_SUB_BITS buckets, so
+ * any value is known within 1/2^HIST_SUB_BITS (3%). Values are clamped
+ * at 2^HIST_MAX_BITS ns, some 18 minutes.
+ */
+#define HIST_SUB_BITS		5
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS		40
+#define HIST_BUCKETS		((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* one writer, any number of concurrent readers: no locks either side */
+struct hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+void hist_reset(struct hist *h);
+void hist_record(struct hist *h, uint64_t value);
+uint64_t hist_percentile(const struct hist *h, double percentile);
+void hist_print(const struct hist *h, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,135 @@
+/**
+ * @file facelockedloop/kalman.c
+ * @brief Kalman filter of the tracked face position, velocity and size.
+ *
+ * The image axes are filtered independently, each with a constant
+ * velocity model driven by white acceleration; the face size is only
+ * smoothed.
+ */
+#include <math.h>
+#include <string.h>
+
+#include "time_utils.h"
+#include "kalman.h"
+
+static
+void kalman_axis_init(struct kalman_axis *a, double z)
+{
+	a->x = z;
+	a->v = 0;
+	a->p[0][0] = KALMAN_NOISE * KALMAN_NOISE;
+	a->p[0][1] = 0;
+	a->p[1][0] = 0;
+	a->p[1][1] = KALMAN_VELOCITY * KALMAN_VELOCITY;
+}
+
+static
+void kalman_axis_predict(struct kalman_axis *a, double dt)
+{
+	double q = KALMAN_ACCEL * KALMAN_ACCEL;
+	double dt2 = dt * dt;
+	double (*p)[2] = a->p;
+
+	a->x += a->v * dt;
+
+	p[0][0] += dt * (p[0][1] + p[1][0]) + dt2 * p[1][1] + q * dt2 * dt2 / 4;
+	p[0][1] += dt * p[1][1] + q * dt2 * dt / 2;
+	p[1][0] += dt * p[1][1] + q * dt2 * dt / 2;
+	p[1][1] += q * dt2;
+}
+
+/* the innovation in sigmas */
+static
+double kalman_axis_distance(const struct kalman_axis *a, double z)
+{
+	return fabs(z - a->x) / sqrt(a->p[0][0] + KALMAN_NOISE * KALMAN_NOISE);
+}
+
+static
+void kalman_axis_update(struct kalman_axis *a, double z)
+{
+	double s = a->p[0][0] + KALMAN_NOISE * KALMAN_NOISE;
+	double k0 = a->p[0][0] / s, k1 = a->p[1][0] / s;
+	double y = z - a->x;
+	double (*p)[2] = a->p;
+
+	a->x += k0 * y;
+	a->v += k1 * y;
+
+	p[1][0] -= k1 * p[0][0];
+	p[1][1] -= k1 * p[0][1];
+	p[0][0] -= k0 * p[0][0];
+	p[0][1] -= k0 * p[0][1];
+}
+
+void kalman_reset(struct kalman_target *k)
+{
+	memset(&k->cx, 0, sizeof(k->cx));
+	memset(&k->cy, 0, sizeof(k->cy));
+	k->size = 0;
+	k->now = 0;
+	k->seen = 0;
+	k->valid = 0;
+}
+
+/* move the state forward to now; the past is left alone */
+void kalman_predict(struct kalman_target *k, unsigned long long now)
+{
+	double dt;
+
+	if (!k->valid || now <= k->now)
+		return;
+
+	dt = (double) (now - k->now) / FLL_NANOSECONDS_IN_SECOND;
+	kalman_axis_predict(&k->cx, dt);
+	kalman_axis_predict(&k->cy, dt);
+	k->now = now;
+}
+
+void kalman_update(struct kalman_target *k, double cx, double cy, double size,
+		   unsigned long long now)
+{
+	kalman_predict(k, now);
+
+	if (k->valid && (kalman_axis_distance(&k->cx, cx) > KALMAN_GATE ||
+			 kalman_axis_distance(&k->cy, cy) > KALMAN_GATE)) {
+		k->resets++;
+		k->valid = 0;
+	}
+
+	if (!k->valid) {
+		kalman_axis_init(&k->cx, cx);
+		kalman_axis_init(&k->cy, cy);
+		k->size = size;
+		k->now = now;
+		k->valid = 1;
+	} else {
+		kalman_axis_update(&k->cx, cx);
+		kalman_axis_update(&k->cy, cy);
+		k->size += 0.5 * (size - k->size);
+	}
+
+	if (now > k->seen)
+		k->seen = now;
+	k->updates++;
+}
+
+/* where the face is expected at now, the state itself is left alone */
+void kalman_position(const struct kalman_target *k, unsigned long long now,
+		     double *cx, double *cy)
+{
+	double dt = 0;
+
+	if (now > k->now)
+		dt = (double) (now - k->now) / FLL_NANOSECONDS_IN_SECOND;
+
+	*cx = k->cx.x + k->cx.v * dt;
+	*cy = k->cy.x + k->cy.v * dt;
+}
+
+/* the camera moved: the whole scene slid across the image */
+void kalman_shift(struct kalman_target *k, double dx, double dy)
+{
+	k->cx.x += dx;
+	k->cy.x += dy;
+}
@@ -0,0 +1,49 @@
+#ifndef __KALMAN_H_
+#define __KALMAN_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* white acceleration of the face in the image, pixels/s^2 */
+#define KALMAN_ACCEL		1000.0
+/* detector jitter, pixels */
+#define KALMAN_NOISE		10.0
+/* initial velocity uncertainty, pixels/s */
+#define KALMAN_VELOCITY		500.0
+/* a measurement this many sigmas off is a new target */
+#define KALMAN_GATE		5.0
+
+/* constant velocity along one image axis */
+struct kalman_axis {
+	double x;
+	double v;
+	double p[2][2];
+};
+
+/* a face: centre and velocity, its size as a random walk */
+struct kalman_target {
+	struct kalman_axis cx;
+	struct kalman_axis cy;
+	double size;
+	/* time the state refers to, and of the last measurement */
+	unsigned long long now;
+	unsigned long long seen;
+	int valid;
+	unsigned long updates;
+	unsigned long resets;
+};
+
+void kalman_reset(struct kalman_target *k);
+void kalman_predict(struct kalman_target *k, unsigned long long now);
+void kalman_update(struct kalman_target *k, double cx, double cy, double size,
+		   unsigned long long now);
+void kalman_position(const struct kalman_target *k, unsigned long long now,
+		     double *cx, double *cy);
+void kalman_shift(struct kalman_target *k, double dx, double dy);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -11,6 +11,7 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <errno.h>
@@ -20,7 +21,29 @@
 #include "detect.h"
 #include "track.h"
 
-static struct pipeline fllpipe;
+/* cameras driven by the process, the first one owns the servos */
+#define FLL_MAX_CAMERAS		4
+/* capture, detection and tracking */
+#define FLL_STAGES		3
+#define FLL_MAX_SCHED		16
+
+struct fll_camera {
+	struct pipeline pipe;
+	struct imager camera;
+	struct detector algorithm;
+	struct tracker servo;
+	struct imager_params camera_params;
+	struct detector_params algorithm_params;
+	struct tracker_params servo_params;
+	int video;
+	char *source;
+	pthread_t driver;
+	int ret;
+};
+
+static struct fll_camera cams[FLL_MAX_CAMERAS];
+static int ncams;
+static struct detect_pool detectors;
 
 static const struct option options[] = {
 	{
@@ -53,6 +76,171 @@ static const struct option options[] = {
 		.has_arg = 1,
 		.flag = NULL,
 	},
+	{
+#define pipelined_opt	5
+		.name = "pipelined",
+		.has_arg = 0,
+		.flag = NULL,
+	},
+	{
+#define queue_opt	6
+		.name = "queue",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define backpressure_opt	7
+		.name = "backpressure",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define frames_opt	8
+		.name = "frames",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define roi_opt		9
+		.name = "roi",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define roi_margin_opt	10
+		.name = "roi_margin",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define detector_opt	11
+		.name = "detector",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define dthreads_opt	12
+		.name = "detect_threads",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define cascade_opt	13
+		.name = "cascade",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define source_opt	14
+		.name = "source",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define pace_opt	15
+		.name = "pace",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define fps_opt		16
+		.name = "fps",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define headless_opt	17
+		.name = "headless",
+		.has_arg = 0,
+		.flag = NULL,
+	},
+	{
+#define preview_opt	18
+		.name = "preview",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define protocol_opt	19
+		.name = "servo_protocol",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define controller_opt	20
+		.name = "controller",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define gains_opt	21
+		.name = "gains",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define slew_opt	22
+		.name = "servo_slew",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define latency_opt	23
+		.name = "servo_latency",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define coast_opt	24
+		.name = "coast",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define every_opt	25
+		.name = "detect_every",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define downscale_opt	26
+		.name = "downscale",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define target_opt	27
+		.name = "target",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define engines_opt	28
+		.name = "detect_engines",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define sched_opt	29
+		.name = "sched",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define sched_file_opt	30
+		.name = "sched_file",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define mlock_opt	31
+		.name = "mlock",
+		.has_arg = 0,
+		.flag = NULL,
+	},
+	{
+		.name = NULL,
+	},
 };
 
 static
@@ -60,28 +248,111 @@ void usage(void)
 {
 	fprintf(stderr, "usage: fll  <options>, with:                   \n");
 	fprintf(stderr, "            --video[=<camera-index>] 	     "
-		":specifies which camera to use (default: any camera)    \n");
+		":specifies which camera to use (default: any camera)    \n"
+		"                                             "
+		" --video and --source repeat, one pipeline per camera   \n");
 	fprintf(stderr, "            --servodevnode=<dev-node-index> "
 		":specifies the servos device control node (default: 0)  \n");
 	fprintf(stderr, "            --min_s=<n>]                    "
 		":specifies min size for the detector (default: 80)     \n");
 	fprintf(stderr, "            --max_s=<n>]                    "
 		":specifies max size for the detector (default: 180)    \n");
+	fprintf(stderr, "            --pipelined                     "
+		":overlap the stages, each one on its own frame          \n");
+	fprintf(stderr, "            --queue=<n>                     "
+		":depth of the queues between stages (default: 2)       \n");
+	fprintf(stderr, "            --backpressure=<policy>         "
+		":block, drop-oldest or drop-newest (default: drop-oldest)\n");
+	fprintf(stderr, "            --frames=<n>                    "
+		":frame buffers in flight (default: queue depth + 2,    "
+		"+ 2 more with a preview)\n");
+	fprintf(stderr, "            --roi=<k>                       "
+		":search around the last face, full scan every k frames "
+		"(default: 0, always full scan)\n");
+	fprintf(stderr, "            --roi_margin=<percent>          "
+		":how much the last face box is expanded (default: 50)  \n");
+	fprintf(stderr, "            --detector=<opencv|native>      "
+		":cascade evaluator to use (default: opencv)            \n");
+	fprintf(stderr, "            --detect_threads=<n>            "
+		":threads sharing the native pyramid scan (default: 1)  \n");
+	fprintf(stderr, "            --detect_engines=<n>            "
+		":cascades run at once for all cameras, up to 4,        \n"
+		"                                             "
+		" one with opencv (default: one per camera)             \n");
+	fprintf(stderr, "            --detect_every=<n>              "
+		":cascade every n frames, follow the face in between,   \n"
+		"                                             "
+		" 0: only once it is lost (default: 1, every frame)     \n");
+	fprintf(stderr, "            --downscale=<n>                 "
+		":detect on a 1/n image, n up to 4 (default: 1)         \n");
+	fprintf(stderr, "            --cascade=<file>                "
+		":map a cascade built by fll-cascade, implies native    \n");
+	fprintf(stderr, "            --source=<file|directory>       "
+		":replay a video file or a directory of images          \n");
+	fprintf(stderr, "            --source=/dev/video<n>          "
+		":read a V4L2 camera's YUYV or GREY buffers directly    \n");
+	fprintf(stderr, "            --source=sim:<face image>       "
+		":track a face through the servos of fll-servosim       \n");
+	fprintf(stderr, "            --pace=<fast|realtime>          "
+		":replay speed of a recording (default: realtime)       \n");
+	fprintf(stderr, "            --fps=<n>                       "
+		":frame rate of an image directory (default: 30)        \n");
+	fprintf(stderr, "            --headless                      "
+		":no display at all                                     \n");
+	fprintf(stderr, "            --preview=<fps>                 "
+		":refresh rate of the detection window (default: 10)    \n");
+	fprintf(stderr, "            --servo_protocol=<ascii|batch>  "
+		":one datagram per channel or all in one (default: ascii)\n");
+	fprintf(stderr, "            --controller=<pid|predictive>   "
+		":servo controller (default: pid)                       \n");
+	fprintf(stderr, "            --gains=<kp[,ki[,kd]]>          "
+		":controller gains, duty per pixel (default: 0.05,0.01,0)\n");
+	fprintf(stderr, "            --servo_slew=<duty/s>           "
+		":servo speed, to know when a move is over (default: 100)\n");
+	fprintf(stderr, "            --servo_latency=<ms>            "
+		":command to motion delay of the servos (default: 50)   \n");
+	fprintf(stderr, "            --coast=<ms>                    "
+		":follow a face missing from the detections (default: 1000)\n");
+	fprintf(stderr, "            --target=<policy>               "
+		":largest, centre or sticky face (default: sticky)      \n");
+	fprintf(stderr, "            --sched=<stage>:<policy>[,<prio>][@<cpus>]\n"
+		"                                             "
+		":run capture, detect, track or a stage id as other,    \n"
+		"                                             "
+		" fifo or rr on a cpu list, e.g. capture:fifo,80@1       \n");
+	fprintf(stderr, "            --sched_file=<file>             "
+		":the same, one stage per line                          \n");
+	fprintf(stderr, "            --mlock                         "
+		":lock all the memory, current and future, in RAM       \n");
 	fprintf(stderr, "            --help                          "
 		"this help\n");
 }
 
+static
+int add_camera(int video, char *source)
+{
+	if (ncams == FLL_MAX_CAMERAS)
+		return -ENOSPC;
+
+	cams[ncams].video = video;
+	cams[ncams].source = source;
+	ncams++;
+
+	return 0;
+}
+
 static
 void *signal_catch(void *arg)
 {
 	sigset_t *monitorset = arg;
-	int sig;
+	int sig, n;
 	
 	for (;;) {
 		sigwait(monitorset, &sig);
 		
 		//printf("caught signal %d. Terminate!\n", sig);
-		pipeline_terminate(&fllpipe, -EINTR);
+		for (n = 0; n < ncams; n++)
+			pipeline_terminate(&cams[n].pipe, -EINTR);
 	}
 	return NULL;
 }
@@ -105,23 +376,117 @@ void setup_term_signals(void)
 	pthread_attr_destroy(&attr);
 }
 
+static
+int setup_camera(struct fll_camera *cam, int n)
+{
+	int ret;
+
+	ret = asprintf(&cam->camera_params.name, "FLL cam%d", n);
+	if (ret < 0)
+		return -ENOMEM;
+
+	ret = asprintf(&cam->algorithm_params.name, "FLL detection %d", n);
+	if (ret < 0)
+		return -ENOMEM;
+
+	cam->camera_params.vididx = cam->video;
+	cam->camera_params.source = cam->source;
+	ret = capture_initialize(&cam->camera, &cam->camera_params, &cam->pipe);
+	if (ret) {
+		printf("cam%d: capture init ret:%d.\n", n, ret);
+		return ret;
+	}
+
+	ret = detect_initialize(&cam->algorithm, &cam->algorithm_params,
+				&cam->pipe);
+	if (ret) {
+		printf("cam%d: detection init ret:%d.\n", n, ret);
+		return ret;
+	}
+
+	/* servolib drives a single pan/tilt pair */
+	cam->servo_params.servos = !n;
+	ret = track_initialize(&cam->servo, &cam->servo_params, &cam->pipe);
+	if (ret) {
+		printf("cam%d: tracking init ret:%d.\n", n, ret);
+		return ret;
+	}
+
+	ret = pipeline_getcount(&cam->pipe);
+	if (ret != FLL_STAGES) {
+		printf("cam%d: missing stages for fll, only %d present.\n", n, ret);
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
+/* each pipeline is run from its own thread */
+static
+void *drive_camera(void *arg)
+{
+	struct fll_camera *cam = arg;
+	int ret;
+
+	for (;;)  {
+		ret = pipeline_run(&cam->pipe);
+		if (ret) {
+			printf("cannot run FLL, ret:%d.\n", ret);
+			break;
+		}
+
+		if (cam->pipe.status == STAGE_ABRT)
+			break;
+	};
+	cam->ret = ret;
+
+	return NULL;
+}
+
 int main(int argc, char *const argv[])
 {
 	struct timespec start_time, stop_time, duration;
-	struct detector_params algorithm_params;
-	struct tracker_params servo_params;
-	struct imager_params camera_params;
-	struct detector algorithm;
-	struct tracker servo;
-	struct imager camera;
+	struct fll_camera *cam;
 	int lindex, c, ret, servodevnode;
 	int dmins, dmaxs;
-	int video = -1;
+	int roi, roi_margin;
+	int dthreads;
+	int engines = 0;
+	struct realtime_params rt;
+	char *scheds[FLL_MAX_SCHED];
+	char *sched_file = NULL;
+	int nscheds = 0;
+	int memlock = 0;
+	int every = 1;
+	int downscale = 1;
+	char *cascade = NULL;
+	enum capture_pacing pacing = CAPTURE_REALTIME;
+	int fps = CAPTURE_DEFAULT_FPS;
+	int preview = PREVIEW_DEFAULT_FPS;
+	enum servoio_protocol protocol = SERVOIO_ASCII;
+	struct controller_params controller;
+	int slew = TRACK_SLEW;
+	int latency = TRACK_LATENCY_MS;
+	int coast = TRACK_COAST_MS;
+	enum track_target target = TRACK_TARGET_STICKY;
+	enum object_detector_t odt;
+	enum queue_policy policy;
+	unsigned int depth;
+	int nframes = 0;
+	int mode, n;
 
 	/* default config options */
 	servodevnode = 0;
 	dmins = 100;
 	dmaxs = 180;
+	roi = 0;
+	roi_margin = 50;
+	mode = PIPELINE_LOCKSTEP;
+	depth = PIPELINE_QUEUE_DEPTH;
+	policy = QUEUE_DROP_OLDEST;
+	odt = CDT_HAAR;
+	dthreads = 1;
+	controller_defaults(&controller);
 
 	for (;;) {
 		lindex = -1;
@@ -133,7 +498,10 @@ int main(int argc, char *const argv[])
 			usage();
 			exit(0);
 		case camera_opt:
-			video = atoi(optarg);
+			if (add_camera(atoi(optarg), NULL)) {
+				usage();
+				exit(1);
+			}
 			break;
 		case trackdev_opt:
 			servodevnode = atoi(optarg);
@@ -144,90 +512,323 @@ int main(int argc, char *const argv[])
 		case dmaxs_opt:
 			dmaxs = atoi(optarg);
 			break;
+		case pipelined_opt:
+			mode = PIPELINE_OVERLAP;
+			break;
+		case queue_opt:
+			depth = atoi(optarg);
+			break;
+		case roi_opt:
+			roi = atoi(optarg);
+			break;
+		case roi_margin_opt:
+			roi_margin = atoi(optarg);
+			break;
+		case frames_opt:
+			nframes = atoi(optarg);
+			break;
+		case detector_opt:
+			if (!strcmp(optarg, "opencv"))
+				odt = CDT_HAAR;
+			else if (!strcmp(optarg, "native"))
+				odt = CDT_HAAR_NATIVE;
+			else {
+				usage();
+				exit(1);
+			}
+			break;
+		case cascade_opt:
+			cascade = optarg;
+			odt = CDT_HAAR_NATIVE;
+			break;
+		case source_opt:
+			if (add_camera(0, optarg)) {
+				usage();
+				exit(1);
+			}
+			break;
+		case pace_opt:
+			if (!strcmp(optarg, "fast"))
+				pacing = CAPTURE_FAST;
+			else if (!strcmp(optarg, "realtime"))
+				pacing = CAPTURE_REALTIME;
+			else {
+				usage();
+				exit(1);
+			}
+			break;
+		case fps_opt:
+			fps = atoi(optarg);
+			if (fps <= 0) {
+				usage();
+				exit(1);
+			}
+			break;
+		case protocol_opt:
+			if (!strcmp(optarg, "ascii"))
+				protocol = SERVOIO_ASCII;
+			else if (!strcmp(optarg, "batch"))
+				protocol = SERVOIO_BATCH;
+			else {
+				usage();
+				exit(1);
+			}
+			break;
+		case controller_opt:
+			if (controller_parse(optarg, &controller.type)) {
+				usage();
+				exit(1);
+			}
+			break;
+		case gains_opt:
+			if (controller_gains_parse(optarg, &controller)) {
+				usage();
+				exit(1);
+			}
+			break;
+		case slew_opt:
+			slew = atoi(optarg);
+			if (slew <= 0) {
+				usage();
+				exit(1);
+			}
+			break;
+		case latency_opt:
+			latency = atoi(optarg);
+			if (latency < 0) {
+				usage();
+				exit(1);
+			}
+			break;
+		case target_opt:
+			if (track_policy_parse(optarg, &target)) {
+				usage();
+				exit(1);
+			}
+			break;
+		case coast_opt:
+			coast = atoi(optarg);
+			if (coast < 0) {
+				usage();
+				exit(1);
+			}
+			break;
+		case headless_opt:
+			preview = 0;
+			break;
+		case preview_opt:
+			preview = atoi(optarg);
+			if (preview <= 0) {
+				usage();
+				exit(1);
+			}
+			break;
+		case every_opt:
+			every = atoi(optarg);
+			if (every < 0) {
+				usage();
+				exit(1);
+			}
+			break;
+		case downscale_opt:
+			downscale = atoi(optarg);
+			if (downscale < 1 || downscale > DETECT_MAX_DOWNSCALE) {
+				usage();
+				exit(1);
+			}
+			break;
+		case dthreads_opt:
+			dthreads = atoi(optarg);
+			break;
+		case sched_opt:
+			if (nscheds == FLL_MAX_SCHED ||
+			    realtime_parse(optarg, &n, &rt)) {
+				usage();
+				exit(1);
+			}
+			scheds[nscheds++] = optarg;
+			break;
+		case sched_file_opt:
+			sched_file = optarg;
+			break;
+		case mlock_opt:
+			memlock = 1;
+			break;
+		case engines_opt:
+			engines = atoi(optarg);
+			if (engines < 1 || engines > DETECT_MAX_ENGINES) {
+				usage();
+				exit(1);
+			}
+			break;
+		case backpressure_opt:
+			if (queue_policy_parse(optarg, &policy)) {
+				usage();
+				exit(1);
+			}
+			break;
 		default:
 			usage();
 			exit(1);
 		}
 	}
 
-	if (video < 0)
-		video = 0;
+	if (!ncams)
+		add_camera(0, NULL);
 
-	setup_term_signals();
+	if (!engines)
+		engines = ncams < DETECT_MAX_ENGINES ? ncams : DETECT_MAX_ENGINES;
+
+	if (!depth || depth > QUEUE_MAX_DEPTH) {
+		usage();
+		exit(1);
+	}
 
-	/* setup the vide pipeline */
-	pipeline_init(&fllpipe);
+	/*
+	 * one buffer being captured, one being detected, the rest queued;
+	 * the preview may hold one waiting and one being copied.
+	 */
+	if (!nframes)
+		nframes = depth + 2 + (preview ? 2 : 0);
 
-	/* first stage */
-	ret = asprintf(&camera_params.name, "FLL cam%d", video);
-	if (ret < 0)
-		goto terminate;
+	if (nframes < 2 || nframes > FRAME_POOL_MAX) {
+		usage();
+		exit(1);
+	}
 
-	camera_params.videocam = NULL;
-	camera_params.vididx = video;
-	camera_params.frame = NULL;
-	ret = capture_initialize(&camera, &camera_params, &fllpipe);
-	if (ret) {
-		printf("capture init ret:%d.\n", ret);
-		goto terminate;
+	/* only the native evaluator understands the binary cascade */
+	if (cascade && odt != CDT_HAAR_NATIVE) {
+		usage();
+		exit(1);
 	}
 
-	/* second stage */
-	algorithm_params.cascade_xml = "haarcascade_frontalface_default.xml";
-	algorithm_params.scratchbuf = NULL;
-	algorithm_params.algorithm = NULL;
-	algorithm_params.srcframe = NULL;
-	algorithm_params.dstframe = NULL;
-	algorithm_params.odt = CDT_HAAR;
+	if (dthreads < 1 || dthreads > HAAR_MAX_THREADS) {
+		usage();
+		exit(1);
+	}
 
-	algorithm_params.min_size = dmins;
-	algorithm_params.max_size = dmaxs;
-	ret = detect_initialize(&algorithm, &algorithm_params, &fllpipe);
-	if (ret) {
-		printf("detection init ret:%d.\n", ret);
-		goto terminate;
+	if (memlock) {
+		ret = realtime_lock_memory();
+		if (ret) {
+			printf("can't lock the memory, ret:%d.\n", ret);
+			return 1;
+		}
 	}
 
-	/* third stage */
-	servo_params.tilt_params.channel = tilt_channel;
-	servo_params.pan_params.channel = pan_channel;
-	servo_params.dev = servodevnode;
-	servo_params.tilt_tgt = 0;
-	servo_params.pan_tgt = 0;
-	ret = track_initialize(&servo , &servo_params, &fllpipe);
+	setup_term_signals();
+
+	/* one cascade in memory for all the cameras */
+	ret = detect_pool_init(&detectors, odt,
+			       "haarcascade_frontalface_default.xml", cascade,
+			       engines, dthreads);
 	if (ret) {
-		printf("tracking init ret:%d.\n", ret);
-		goto terminate;
+		printf("detection pool init ret:%d.\n", ret);
+		return 1;
 	}
 
-	ret = pipeline_getcount(&fllpipe);
-	if (ret != PIPELINE_MAX_STAGE) {
-		printf("missing stages for fll, only %d present.\n", ret);
-		goto terminate;
+	for (n = 0; n < ncams; n++) {
+		cam = &cams[n];
+
+		/* setup the video pipeline */
+		pipeline_init(&cam->pipe, mode);
+		for (c = CAPTURE_STAGE; c <= TRACKING_STAGE; c++)
+			pipeline_set_link(&cam->pipe, c, depth, policy);
+
+		/* the file first, the command line has the last word */
+		if (sched_file) {
+			ret = realtime_load(&cam->pipe, sched_file);
+			if (ret)
+				goto terminate;
+		}
+		for (c = 0; c < nscheds; c++)
+			realtime_apply(&cam->pipe, scheds[c]);
+
+		/* first stage */
+		cam->camera_params.videocam = NULL;
+		cam->camera_params.pacing = pacing;
+		cam->camera_params.fps = fps;
+		cam->camera_params.frame = NULL;
+		cam->camera_params.nframes = nframes;
+
+		/* second stage */
+		cam->algorithm_params.pool = &detectors;
+		cam->algorithm_params.srcframe = NULL;
+		cam->algorithm_params.dstframe = NULL;
+		cam->algorithm_params.min_size = dmins;
+		cam->algorithm_params.max_size = dmaxs;
+		cam->algorithm_params.roi_period = roi;
+		cam->algorithm_params.roi_margin = roi_margin;
+		cam->algorithm_params.detect_period = every;
+		cam->algorithm_params.downscale = downscale;
+		cam->algorithm_params.follow_confidence = DETECT_FOLLOW_CONFIDENCE;
+		cam->algorithm_params.preview_fps = preview;
+
+		/* third stage */
+		cam->servo_params.tilt_params.channel = tilt_channel;
+		cam->servo_params.pan_params.channel = pan_channel;
+		cam->servo_params.dev = servodevnode;
+		cam->servo_params.protocol = protocol;
+		cam->servo_params.controller = controller;
+		cam->servo_params.slew = slew;
+		cam->servo_params.latency_ms = latency;
+		cam->servo_params.coast_ms = coast;
+		cam->servo_params.policy = target;
+		cam->servo_params.target_report = &cam->algorithm.target;
+		cam->servo_params.tilt_tgt = 0;
+		cam->servo_params.pan_tgt = 0;
+
+		ret = setup_camera(cam, n);
+		if (ret)
+			goto terminate;
 	}
 
 	/**
-	 * execute the video pipeline
+	 * execute the video pipelines
 	 */
 	clock_gettime(CLOCK_MONOTONIC, &start_time);
-	for (;;)  {
-		ret = pipeline_run(&fllpipe);
+	for (n = 0; n < ncams; n++) {
+		ret = pthread_create(&cams[n].driver, NULL, drive_camera,
+				     &cams[n]);
 		if (ret) {
-			printf("cannot run FLL, ret:%d.\n", ret);
+			printf("cam%d: cannot start, ret:%d.\n", n, ret);
 			break;
 		}
+	}
 
-		if (fllpipe.status == STAGE_ABRT)
-			break;
-	};
+	/* a camera that could not start stops the others */
+	if (n < ncams)
+		for (c = 0; c < n; c++)
+			pipeline_terminate(&cams[c].pipe, -EINTR);
+
+	for (c = 0; c < n; c++)
+		pthread_join(cams[c].driver, NULL);
+
+	/* the stages of a terminated pipeline may still free-run */
+	for (c = 0; c < ncams; c++)
+		pipeline_stop(&cams[c].pipe);
 
 	clock_gettime(CLOCK_MONOTONIC, &stop_time);
 	timespec_substract(&duration, &stop_time, &start_time);
 	printf("duration->  %lds %ldns .\n", duration.tv_sec , duration.tv_nsec);
+	for (n = 0; n < ncams; n++) {
+		if (ncams > 1)
+			printf("cam%d:\n", n);
+		pipeline_printstats(&cams[n].pipe);
+	}
 
 terminate:
-	free(camera_params.name);
-	pipeline_teardown(&fllpipe);
+	/* none of them runs while any is torn down: they share the pool */
+	for (n = 0; n < ncams; n++)
+		pipeline_stop(&cams[n].pipe);
+
+	for (n = 0; n < ncams; n++) {
+		if (ncams > 1)
+			printf("cam%d:\n", n);
+		pipeline_teardown(&cams[n].pipe);
+		free(cams[n].camera_params.name);
+		free(cams[n].algorithm_params.name);
+	}
+	detect_pool_destroy(&detectors);
 
 	return 0;
 }
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <pthread.h>
 #include <semaphore.h>
@@ -7,25 +8,93 @@
 #include "pipeline.h"
 #include "time_utils.h"
 
+static const struct pipeline_link default_link = {
+	.depth = PIPELINE_QUEUE_DEPTH,
+	.policy = QUEUE_DROP_OLDEST,
+	.rt = {
+		.policy = SCHED_OTHER,
+		.priority = 0,
+		.cpus = 0,
+	},
+};
+
+static
+const struct pipeline_link *pipeline_link(struct pipeline *pipe, int nth_stage)
+{
+	if (nth_stage < 0 || nth_stage >= pipe->nlinks)
+		return &default_link;
+
+	return &pipe->links[nth_stage];
+}
+
+static
+void stage_account(struct stage *stg, unsigned long long start,
+		   unsigned long long end, int ret)
+{
+	struct stage_stats *st = &stg->stats;
+	struct timespec busy;
+
+	hist_record(&st->service, end - start);
+	busy.tv_sec = (end - start) / FLL_NANOSECONDS_IN_SECOND;
+	busy.tv_nsec = (end - start) % FLL_NANOSECONDS_IN_SECOND;
+	timespec_add(&stg->duration, &busy);
+
+	if (ret || !stg->params.birth)
+		return;
+
+	if (!st->frames)
+		st->first = start;
+	st->last = end;
+	st->frames++;
+	hist_record(&st->age, end - stg->params.birth);
+}
+
 static void *stage_worker(void *arg)
 {
 	struct stage *step = arg;
-	int ret;
+	unsigned long long start;
+	int freerun = 0;
+	int ret = 0;
 
 	for (;;) {
-		ret = sem_wait(&step->nowait);
-		if (ret)
-			printf("step %d wait error %d.\n",step->params.nth_stage, ret);
+		if (!freerun) {
+			ret = sem_wait(&step->nowait);
+			if (ret)
+				printf("step %d wait error %d.\n",step->params.nth_stage, ret);
+			if (step->pipeline->mode == PIPELINE_LOCKSTEP)
+				hist_record(&step->stats.wakeup,
+					    monotonic_nsecs() - step->kicked);
+
+			/* once started, overlapped stages no longer wait for
+			 * the pipeline: the input queue paces them
+			 */
+			freerun = step->pipeline->mode == PIPELINE_OVERLAP;
+		}
 
 		if (step->ops->input)
 			ret = step->ops->input(step, NULL);
 		if (ret)
 			printf("step %d input error %d.\n", step->params.nth_stage, ret);
 
+		start = monotonic_nsecs();
 		ret = step->ops->run(step);
+		stage_account(step, start, monotonic_nsecs(), ret);
 		if (ret)
 			printf("step %d run error %d.\n", step->params.nth_stage, ret);
 
+		if (freerun) {
+			if (step->nouts && step->ops->output && step->params.data_out)
+				step->ops->output(step, step->params.data_out);
+
+			/* a terminated pipeline parks its stages until teardown */
+			if (step->pipeline->status == STAGE_ABRT)
+				freerun = 0;
+
+			/* only the sink reports a completed frame */
+			if (step != step->pipeline->sink)
+				continue;
+		}
+
 		sem_post(&step->done);
 	}
 	if (ret < 0)
@@ -36,18 +105,41 @@ static void *stage_worker(void *arg)
 
 void stage_up(struct stage *stg, struct stage_params *p, struct stage_ops *o, struct pipeline *pipe)
 {
+	const struct pipeline_link *link = pipeline_link(pipe, p->nth_stage);
 	pthread_attr_t attr;
+	int ret;
 
+	stg->self = stg;
 	stg->pipeline = pipe;
-	stg->next = NULL;
+	stg->upstream = NULL;
+	stg->nouts = 0;
+	stg->fed = 0;
 	stg->params = *p;
+	stg->params.birth = 0;
 	stg->ops = o;
+	timespec_zero(&stg->duration);
+	memset(&stg->stats, 0, sizeof(stg->stats));
 
 	sem_init(&stg->nowait, 0, 0);
 	sem_init(&stg->done, 0, 0);
 
-	pthread_mutex_init(&stg->lock, NULL);
-	pthread_cond_init(&stg->sync, NULL);
+	queue_init(&stg->queue, link->depth, link->policy);
+	stg->kicked = 0;
+	stg->flags = 0;
+	stg->rt = link->rt;
+	ret = realtime_attr_init(&attr, &stg->rt);
+	if (!ret) {
+		ret = -pthread_create(&stg->worker, &attr, stage_worker, stg);
+		pthread_attr_destroy(&attr);
+	}
+	if (!ret)
+		return;
+
+	/* most likely not privileged enough: run like any other thread */
+	printf("stage %d: can't run %s/%d, ret:%d, using defaults.\n",
+	       p->nth_stage, realtime_policy_name(stg->rt.policy),
+	       stg->rt.priority, ret);
+	stg->rt = default_link.rt;
 	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 	pthread_create(&stg->worker, &attr, stage_worker, stg);
@@ -56,6 +148,7 @@ void stage_up(struct stage *stg, struct stage_params *p, struct stage_ops *o, st
 
 void stage_go(struct stage *stg)
 {
+	stg->kicked = monotonic_nsecs();
 	sem_post(&stg->nowait);
 }
 
@@ -69,90 +162,331 @@ void stage_wait(struct stage *stg)
 
 int stage_output(struct stage *stg, void *it)
 {
-	struct stage *next = stg->next;
+	void *dropped;
+	int ret, n;
 
-	if (!next)
-		return 0;
+	/* each consumer owns a reference to the item */
+	for (n = 1; n < stg->nouts; n++)
+		stg->ops->hold(stg, it);
 
-	pthread_mutex_lock(&next->lock);
-	next->params.data_in = it;
-	pthread_cond_signal(&next->sync);
-	pthread_mutex_unlock(&next->lock);
+	for (n = 0; n < stg->nouts; n++) {
+		ret = queue_push(&stg->outs[n]->queue, it, &dropped);
+		if (ret)
+			goto unpushed;
+
+		/* backpressure policy rejected an item: hand it back */
+		if (dropped && stg->ops->release)
+			stg->ops->release(stg, dropped);
+	}
 
 	return 0;
+
+unpushed:
+	/* nobody will drop the references of the consumers left out */
+	for (; n < stg->nouts; n++)
+		if (stg->ops->release)
+			stg->ops->release(stg, it);
+
+	return ret;
+}
+
+/* how many of its items the consumers of a stage may queue or hold */
+unsigned int stage_output_depth(struct stage *stg)
+{
+	unsigned int depth = 0;
+	int n;
+
+	for (n = 0; n < stg->nouts; n++)
+		depth += stg->outs[n]->queue.depth + 1;
+
+	return depth;
 }
 
 int stage_input(struct stage *stg, void **it)
 {
-	pthread_mutex_lock(&stg->lock);
-	while (stg->params.data_in == NULL)
-		pthread_cond_wait(&stg->sync, &stg->lock);
+	int ret;
 
-	*it = stg->params.data_in;
-	pthread_mutex_unlock(&stg->lock);
+	ret = queue_pop(&stg->queue, it);
+	if (ret)
+		return ret;
+
+	stg->params.data_in = *it;
 
 	return 0;
 }
 	
-void stage_down(struct stage *stg)
+/* nothing runs on behalf of the stage once this returns */
+void stage_stop(struct stage *stg)
 {
+	if (stg->flags & STAGE_STOPPED)
+		return;
+
 	pthread_cancel(stg->worker);
 	pthread_join(stg->worker, NULL);
-	pthread_cond_destroy(&stg->sync);
-	pthread_mutex_destroy(&stg->lock);
+	stg->flags |= STAGE_STOPPED;
+}
+
+void stage_down(struct stage *stg)
+{
+	stage_stop(stg);
+	queue_destroy(&stg->queue);
 	sem_destroy(&stg->nowait);
 	sem_destroy(&stg->done);
 }
 
 void stage_printstats(struct stage *stg)
 {
-	return;
+	struct queue_stats *qs = &stg->queue.stats;
+	struct stage_stats *st = &stg->stats;
+	double fps = 0;
+
+	if (st->frames > 1)
+		fps = (double) (st->frames - 1) * FLL_NANOSECONDS_IN_SECOND /
+			(st->last - st->first);
+
+	printf("stage %d: %lu frames, %.2f fps, busy %lds %ldns.\n",
+	       stg->params.nth_stage, st->frames, fps,
+	       stg->duration.tv_sec, stg->duration.tv_nsec);
+	if (stg->rt.policy != SCHED_OTHER || stg->rt.cpus)
+		printf("    thread %s/%d, cpus 0x%lx.\n",
+		       realtime_policy_name(stg->rt.policy), stg->rt.priority,
+		       stg->rt.cpus);
+	hist_print(&st->service, "service");
+	/* let go by the pipeline in lockstep, woken up by an item otherwise */
+	if (stg->pipeline->mode == PIPELINE_LOCKSTEP)
+		hist_print(&st->wakeup, "kick");
+	else
+		hist_print(&qs->wakeup, "item");
+	hist_print(&qs->wait, "wait");
+	hist_print(&st->age, "age");
+
+	/* the capture stage has no upstream link */
+	if (!qs->pushed)
+		return;
+
+	printf("    queue %u/%s, pushed %lu, popped %lu, dropped %lu, "
+	       "occupancy avg %.2f max %u.\n",
+	       stg->queue.depth, queue_policy_name(stg->queue.policy),
+	       qs->pushed, qs->popped, qs->dropped,
+	       (double) qs->occupancy / qs->pushed, qs->max_occupancy);
 }
 
-void pipeline_init(struct pipeline *pipe)
+void pipeline_init(struct pipeline *pipe, int mode)
 {
-	memset(pipe->stgs, 0, PIPELINE_MAX_STAGE);
-	pipe->status = 0;
+	pipe->stgs = NULL;
 	pipe->count = 0;
+	pipe->size = 0;
+	pipe->links = NULL;
+	pipe->nlinks = 0;
+	pipe->sink = NULL;
+	pipe->status = 0;
+	pipe->mode = mode;
+	pipe->running = 0;
+}
+
+static
+int pipeline_grow_links(struct pipeline *pipe, int nth_stage)
+{
+	struct pipeline_link *links;
+	int n;
+
+	if (nth_stage < pipe->nlinks)
+		return 0;
+
+	if (nth_stage >= PIPELINE_MAX_STAGES)
+		return -EINVAL;
+
+	links = realloc(pipe->links, (nth_stage + 1) * sizeof(*links));
+	if (!links)
+		return -ENOMEM;
+
+	for (n = pipe->nlinks; n <= nth_stage; n++)
+		links[n] = default_link;
+	pipe->links = links;
+	pipe->nlinks = nth_stage + 1;
+
+	return 0;
+}
+
+int pipeline_set_link(struct pipeline *pipe, int nth_stage, unsigned int depth,
+		      enum queue_policy policy)
+{
+	int ret;
+
+	if (nth_stage < 0)
+		return -EINVAL;
+
+	if (!depth || depth > QUEUE_MAX_DEPTH)
+		return -EINVAL;
+
+	ret = pipeline_grow_links(pipe, nth_stage);
+	if (ret)
+		return ret;
+
+	pipe->links[nth_stage].depth = depth;
+	pipe->links[nth_stage].policy = policy;
+
+	return 0;
+}
+
+int pipeline_set_realtime(struct pipeline *pipe, int nth_stage,
+			  const struct realtime_params *rt)
+{
+	int ret;
+
+	if (nth_stage < 0)
+		return -EINVAL;
+
+	ret = pipeline_grow_links(pipe, nth_stage);
+	if (ret)
+		return ret;
+
+	pipe->links[nth_stage].rt = *rt;
+
+	return 0;
+}
+
+unsigned int pipeline_link_depth(struct pipeline *pipe, int nth_stage)
+{
+	return pipeline_link(pipe, nth_stage)->depth;
+}
+
+static
+struct stage *pipeline_find(struct pipeline *pipe, int nth_stage)
+{
+	int n;
+
+	for (n = 0; n < pipe->count; n++)
+		if (pipe->stgs[n]->params.nth_stage == nth_stage)
+			return pipe->stgs[n];
+
+	return NULL;
+}
+
+/* follow the first consumer of the first source down to a leaf */
+static
+void pipeline_find_sink(struct pipeline *pipe)
+{
+	struct stage *s = pipe->count ? pipe->stgs[0] : NULL;
+
+	while (s && s->nouts)
+		s = s->outs[0];
+
+	pipe->sink = s;
 }
 
 int pipeline_register(struct pipeline *pipe, struct stage *stg)
 {
+	struct stage **stgs, *up = NULL;
+
 	if (!stg)
 		return -EINVAL;
 
-	pipe->stgs[stg->params.nth_stage] = stg;
+	if (pipeline_find(pipe, stg->params.nth_stage))
+		return -EEXIST;
 
-	if (stg->params.nth_stage <= 0)
-		goto done;
+	/* producers register before their consumers */
+	if (stg->params.upstream != STAGE_SOURCE) {
+		up = pipeline_find(pipe, stg->params.upstream);
+		if (!up)
+			return -ENOENT;
 
-	if (stg->params.nth_stage <= PIPELINE_MAX_STAGE)
-		pipe->stgs[stg->params.nth_stage-1]->next = stg;
-done:
-	++(pipe->count);
+		if (up->nouts == PIPELINE_MAX_FANOUT ||
+		    (up->nouts && !up->ops->hold))
+			return -ENOSPC;
+	}
+
+	if (pipe->count == pipe->size) {
+		stgs = realloc(pipe->stgs, (pipe->size + 4) * sizeof(*stgs));
+		if (!stgs)
+			return -ENOMEM;
+		pipe->stgs = stgs;
+		pipe->size += 4;
+	}
+
+	pipe->stgs[pipe->count++] = stg;
+	if (up) {
+		stg->upstream = up;
+		up->outs[up->nouts++] = stg;
+	}
+	pipeline_find_sink(pipe);
 
 	return 0;	
 }
 
 int pipeline_deregister(struct pipeline *pipe, struct stage *stg)
 {
+	struct stage *up;
+	int n;
+
 	if (!stg)
 		return -EINVAL;
-	
-	pipe->stgs[stg->params.nth_stage] = NULL;
+
+	for (n = 0; n < pipe->count; n++)
+		if (pipe->stgs[n] == stg)
+			break;
+	if (n == pipe->count)
+		return -ENOENT;
+
+	memmove(&pipe->stgs[n], &pipe->stgs[n + 1],
+		(pipe->count - n - 1) * sizeof(*pipe->stgs));
 	--(pipe->count);
 
+	up = stg->upstream;
+	if (up) {
+		for (n = 0; up->outs[n] != stg; n++)
+			;
+		memmove(&up->outs[n], &up->outs[n + 1],
+			(up->nouts - n - 1) * sizeof(*up->outs));
+		up->nouts--;
+	}
+	stg->upstream = NULL;
+	pipeline_find_sink(pipe);
+
 	return 0;	
 }
 
+static
+int pipeline_run_overlapped(struct pipeline *pipe)
+{
+	struct stage *s;
+	int ret, n;
+
+	if (!pipe->running) {
+		for (n = 0; n < pipe->count; n++) {
+			s = pipe->stgs[n];
+			s->ops->go(s);
+		}
+		pipe->running = 1;
+	}
+
+	/* all stages free-run: wait for one frame to leave the pipeline */
+	s = pipe->sink;
+	ret = sem_wait(&s->done);
+	if (ret) {
+		printf("step %d done error %d.\n", s->params.nth_stage, ret);
+		return -EIO;
+	}
+
+	return 0;
+}
+
 int pipeline_run(struct pipeline *pipe)
 {
 	struct stage *s;
 	int ret, n;
 
-	for (n = CAPTURE_STAGE; n < PIPELINE_MAX_STAGE; n++) {
+	if (pipe->mode == PIPELINE_OVERLAP)
+		return pipeline_run_overlapped(pipe);
+
+	/* a stage only runs once its upstream has produced an item */
+	for (n = 0; n < pipe->count; n++) {
 
 		s = pipe->stgs[n];
+		s->fed = 0;
+		if (s->upstream && !s->upstream->fed)
+			continue;
+
 		s->ops->go(s);
 
 		ret = sem_wait(&s->done);
@@ -162,9 +496,10 @@ int pipeline_run(struct pipeline *pipe)
 		}
 
 		if (!s->params.data_out)
-		    break;
+		    continue;
 
-		if (s->ops->output && s->next) 
+		s->fed = 1;
+		if (s->ops->output && s->nouts) 
 			s->ops->output(s, s->params.data_out);
 	}
 
@@ -174,6 +509,10 @@ int pipeline_run(struct pipeline *pipe)
 void pipeline_terminate(struct pipeline *pipe, int reason)
 {
 	pipe->status = STAGE_ABRT;
+
+	/* wake up pipeline_run should the last stage be starving */
+	if (pipe->running && pipe->sink)
+		sem_post(&pipe->sink->done);
 }
 
 int pipeline_pause(struct pipeline *pipe)
@@ -181,7 +520,7 @@ int pipeline_pause(struct pipeline *pipe)
 	struct stage *s;
 	int n, ret = 0;
 	
-	for (n = CAPTURE_STAGE; n < PIPELINE_MAX_STAGE; n++) {
+	for (n = 0; n < pipe->count; n++) {
 		s = pipe->stgs[n];
 		s->ops->wait(s);
 	}
@@ -189,21 +528,49 @@ int pipeline_pause(struct pipeline *pipe)
 	return ret;
 }
 
+int pipeline_printstats(struct pipeline *pipe)
+{
+	int n;
+
+	for (n = 0; n < pipe->count; n++)
+		stage_printstats(pipe->stgs[n]);
+
+	return 0;
+}
+
 int pipeline_getcount(struct pipeline *pipe)
 {
 	return pipe->count;
 }
 
+/* cancel and join every worker, the stages stay set up */
+void pipeline_stop(struct pipeline *pipe)
+{
+	int n;
+
+	for (n = pipe->count - 1; n >= 0; n--)
+		stage_stop(pipe->stgs[n]);
+}
+
 void pipeline_teardown(struct pipeline *pipe)
 {
 	struct stage *s;
 	int n;
-	
-	for (n = CAPTURE_STAGE; n < PIPELINE_MAX_STAGE; n++) {
+
+	/*
+	 * free-running workers may be anywhere in run(): stop them all
+	 * before any stage frees what the others could still be using
+	 */
+	pipeline_stop(pipe);
+
+	/* consumers first: they may still reference upstream buffers */
+	for (n = pipe->count - 1; n >= 0; n--) {
 		s = pipe->stgs[n];
-		if (s && s->self) {
-			printf("%s: run stage %d.\n", __func__, s->params.nth_stage);
-			s->ops->down(s);
-		}
+		printf("%s: run stage %d.\n", __func__, s->params.nth_stage);
+		s->ops->down(s);
 	}
+
+	free(pipe->stgs);
+	free(pipe->links);
+	pipeline_init(pipe, pipe->mode);
 }
@@ -4,25 +4,48 @@
 #include <pthread.h>
 #include <semaphore.h>
 
+#include "queue.h"
+#include "hist.h"
+#include "realtime.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 
+/* ids of the fll stages; others may be added with any unused id */
 #define CAPTURE_STAGE		0
 #define DETECTION_STAGE		1
 #define TRACKING_STAGE		2
-#define PIPELINE_MAX_STAGE	3
+
+/* consumers a stage can feed, each through its own queue */
+#define PIPELINE_MAX_FANOUT	4
+/* stage ids are below this, links are allocated up to the highest one */
+#define PIPELINE_MAX_STAGES	64
+/* upstream of a stage that produces its own items */
+#define STAGE_SOURCE		-1
 
 struct pipeline;
 struct stage;
 
 #define STAGE_ABRT		0x1
+/* stage flags: the worker is cancelled and joined */
+#define STAGE_STOPPED		0x2
+
+/* lock-step: one frame at a time through all stages
+ * overlap: every stage free-runs on its own frame
+ */
+#define PIPELINE_LOCKSTEP	0
+#define PIPELINE_OVERLAP	1
 	
 struct stage_params {
 	int nth_stage;
+	/* id of the stage feeding this one, or STAGE_SOURCE */
+	int upstream;
 	void *data_in;
 	void *data_out;
+	/* capture time of the frame being worked on, 0 if none */
+	unsigned long long birth;
 };
 
 struct stage_ops {
@@ -34,6 +57,20 @@ struct stage_ops {
 	void (*wait)(struct stage *stg);
 	int (*run)(struct stage *stg);
 	void (*go)(struct stage *stg);
+	void (*release)(struct stage *stg, void *it);
+	/* one more reference to an output item, for fan-out */
+	void (*hold)(struct stage *stg, void *it);
+};
+
+struct stage_stats {
+	/* run() time, and frame age once run() is done with it */
+	struct hist service;
+	struct hist age;
+	/* from being let go by the pipeline to running */
+	struct hist wakeup;
+	unsigned long long first;
+	unsigned long long last;
+	unsigned long frames;
 };
 
 struct stage {
@@ -41,33 +78,71 @@ struct stage {
 	struct stage_ops *ops;
 	struct stage_params params;
 	struct pipeline *pipeline;
-	struct stage* next;
+	struct stage *upstream;
+	struct stage *outs[PIPELINE_MAX_FANOUT];
+	int nouts;
+	/* lock-step: produced an item this round */
+	int fed;
+	/* time spent in run() */
 	struct timespec duration;
+	struct stage_stats stats;
 	pthread_t worker;
-	pthread_mutex_t lock;
-	pthread_cond_t sync;
+	/* how the worker actually runs */
+	struct realtime_params rt;
+	unsigned long long kicked;
+	struct queue queue;
 	sem_t nowait;
 	sem_t done;
 	int flags;
 };
 
 void stage_up(struct stage *stg,  struct stage_params *p,struct stage_ops *o, struct pipeline *pipe);
+void stage_stop(struct stage *stg);
 void stage_down(struct stage *stg);	
 void stage_go(struct stage *stg);
 void stage_wait(struct stage *stg); 
 int stage_output(struct stage *stg, void *it);
+unsigned int stage_output_depth(struct stage *stg);
 int stage_input(struct stage *stg, void **it);
 void stage_printstats(struct stage *stg);
 
+#define PIPELINE_QUEUE_DEPTH	2
+
+/* configuration of a stage: the queue feeding it and its worker thread */
+struct pipeline_link {
+	unsigned int depth;
+	enum queue_policy policy;
+	struct realtime_params rt;
+};
+
+/*
+ * stages form a tree rooted at the sources: an item flows from a stage to
+ * every stage registered with it as upstream. Stages are kept in the
+ * order they registered, producers before their consumers.
+ */
 struct pipeline {
-	struct stage *stgs[PIPELINE_MAX_STAGE];
+	struct stage **stgs;
 	int count;
+	int size;
+	/* indexed by stage id, grown as links are configured */
+	struct pipeline_link *links;
+	int nlinks;
+	/* the stage a completed frame is reported by */
+	struct stage *sink;
 	int status;
+	int mode;
+	int running;
 };
 
-void pipeline_init(struct pipeline *pipe);
+void pipeline_init(struct pipeline *pipe, int mode);
+int pipeline_set_link(struct pipeline *pipe, int nth_stage, unsigned int depth,
+		      enum queue_policy policy);
+int pipeline_set_realtime(struct pipeline *pipe, int nth_stage,
+			  const struct realtime_params *rt);
+unsigned int pipeline_link_depth(struct pipeline *pipe, int nth_stage);
 int pipeline_register(struct pipeline *pipe, struct stage *stg);
 int pipeline_deregister(struct pipeline *pipe, struct stage *stg);
+void pipeline_stop(struct pipeline *pipe);
 void pipeline_teardown(struct pipeline *pipe);
 int pipeline_run(struct pipeline *pipe);
 int pipeline_pause(struct pipeline *pipe);
@@ -0,0 +1,174 @@
+/**
+ * @file facelockedloop/preview.c
+ * @brief Asynchronous display of the detection results.
+ *
+ * Posting only takes a frame reference and copies the boxes; the copy,
+ * the overlay and every HighGUI call happen on the preview thread, at
+ * most at the preview rate.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "time_utils.h"
+#include "preview.h"
+
+#include "highgui/highgui_c.h"
+#include "imgproc/imgproc_c.h"
+
+static
+void preview_overlay(IplImage *img, const struct store_box *boxes, int n)
+{
+	CvPoint ptA, ptB;
+	char text[32];
+	CvFont font;
+	int i;
+
+	cvInitFont(&font, CV_FONT_HERSHEY_PLAIN, 1.0, 1.0, 0, 1, 8);
+
+	for (i = 0; i < n; i++) {
+		ptA = cvPoint(boxes[i].ptA_x, boxes[i].ptA_y);
+		ptB = cvPoint(boxes[i].ptB_x, boxes[i].ptB_y);
+		cvRectangle(img, ptA, ptB, CV_RGB(0,255,0), 2, 5, 0 );
+
+		snprintf(text, sizeof(text), "detected: %dx%d",
+			 ptB.x - ptA.x, ptB.y - ptA.y);
+		ptB.y += 15;
+		ptB.x = ptA.x;
+		cvPutText(img, text, ptB, &font, CV_RGB(0,255,0));
+	}
+}
+
+/* only the preview ever needs the colours of a camera frame */
+static
+void preview_convert(struct frame *f, IplImage *canvas)
+{
+	switch (f->format) {
+	case FRAME_YUYV:
+		cvCvtColor(f->image, canvas, CV_YUV2BGR_YUYV);
+		break;
+	case FRAME_GREY:
+		cvCvtColor(f->image, canvas, CV_GRAY2BGR);
+		break;
+	case FRAME_BGR:
+		cvCopy(f->image, canvas, NULL);
+		break;
+	}
+}
+
+static
+void *preview_thread(void *arg)
+{
+	struct store_box boxes[STORE_MAX_BOXES];
+	struct preview *pv = arg;
+	struct frame *f;
+	int n;
+
+	cvNamedWindow(pv->name, CV_WINDOW_AUTOSIZE);
+
+	for (;;) {
+		pthread_mutex_lock(&pv->lock);
+		while (!pv->pending && !pv->quit)
+			pthread_cond_wait(&pv->cond, &pv->lock);
+
+		if (pv->quit) {
+			pthread_mutex_unlock(&pv->lock);
+			break;
+		}
+
+		f = pv->pending;
+		pv->pending = NULL;
+		n = pv->nboxes;
+		memcpy(boxes, pv->boxes, n * sizeof(boxes[0]));
+		pthread_mutex_unlock(&pv->lock);
+
+		/* the frame is shared: draw on a private copy */
+		if (!pv->canvas)
+			pv->canvas = cvCreateImage(cvGetSize(f->image),
+						   IPL_DEPTH_8U, 3);
+		preview_convert(f, pv->canvas);
+		frame_put(f);
+
+		preview_overlay(pv->canvas, boxes, n);
+		cvShowImage(pv->name, pv->canvas);
+		cvWaitKey(1);
+		pv->shown++;
+	}
+
+	cvDestroyWindow(pv->name);
+
+	return NULL;
+}
+
+int preview_init(struct preview *pv, char *name, int fps)
+{
+	int ret;
+
+	if (fps <= 0)
+		return -EINVAL;
+
+	memset(pv, 0, sizeof(*pv));
+	pv->name = name;
+	pv->period_ns = FLL_NANOSECONDS_IN_SECOND / fps;
+	pthread_mutex_init(&pv->lock, NULL);
+	pthread_cond_init(&pv->cond, NULL);
+
+	ret = pthread_create(&pv->thread, NULL, preview_thread, pv);
+	if (ret) {
+		pthread_cond_destroy(&pv->cond);
+		pthread_mutex_destroy(&pv->lock);
+		return -ret;
+	}
+
+	return 0;
+}
+
+void preview_post(struct preview *pv, struct frame *f,
+		  const struct store_box *boxes, int nboxes)
+{
+	struct timespec now, delta;
+	struct frame *old;
+
+	/* frames in between are never even referenced */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespec_substract(&delta, &now, &pv->last);
+	if (!delta.tv_sec && delta.tv_nsec < pv->period_ns)
+		return;
+	pv->last = now;
+
+	if (nboxes > STORE_MAX_BOXES)
+		nboxes = STORE_MAX_BOXES;
+
+	frame_hold(f);
+
+	pthread_mutex_lock(&pv->lock);
+	old = pv->pending;
+	pv->pending = f;
+	pv->nboxes = nboxes;
+	memcpy(pv->boxes, boxes, nboxes * sizeof(boxes[0]));
+	if (old)
+		pv->replaced++;
+	pthread_cond_signal(&pv->cond);
+	pthread_mutex_unlock(&pv->lock);
+
+	if (old)
+		frame_put(old);
+}
+
+void preview_destroy(struct preview *pv)
+{
+	pthread_mutex_lock(&pv->lock);
+	pv->quit = 1;
+	pthread_cond_signal(&pv->cond);
+	pthread_mutex_unlock(&pv->lock);
+
+	pthread_join(pv->thread, NULL);
+
+	if (pv->pending)
+		frame_put(pv->pending);
+	if (pv->canvas)
+		cvReleaseImage(&pv->canvas);
+
+	pthread_cond_destroy(&pv->cond);
+	pthread_mutex_destroy(&pv->lock);
+}
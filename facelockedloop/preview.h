@@ -0,0 +1,45 @@
+#ifndef __PREVIEW_H_
+#define __PREVIEW_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <time.h>
+
+#include "frame.h"
+#include "store.h"
+
+#define PREVIEW_DEFAULT_FPS	10
+
+/*
+ * the display runs on its own thread: the detector posts its latest frame
+ * and boxes, a newer post replaces one not shown yet.
+ */
+struct preview {
+	char *name;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct frame *pending;
+	struct store_box boxes[STORE_MAX_BOXES];
+	int nboxes;
+	IplImage *canvas;
+	struct timespec last;
+	long period_ns;
+	unsigned long shown;
+	unsigned long replaced;
+	int quit;
+};
+
+int preview_init(struct preview *pv, char *name, int fps);
+void preview_post(struct preview *pv, struct frame *f,
+		  const struct store_box *boxes, int nboxes);
+void preview_destroy(struct preview *pv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
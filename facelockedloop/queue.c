@@ -0,0 +1,214 @@
+/**
+ * @file facelockedloop/queue.c
+ * @brief Bounded lock-free queue linking two pipeline stages.
+ *
+ * The fast path is a pair of atomic loads and one store; the semaphores
+ * are only touched when a side has announced it is going to sleep.
+ */
+#include <errno.h>
+#include <string.h>
+#include <semaphore.h>
+
+#include "time_utils.h"
+#include "queue.h"
+
+static const char *policy_names[] = {
+	[QUEUE_BLOCK] = "block",
+	[QUEUE_DROP_OLDEST] = "drop-oldest",
+	[QUEUE_DROP_NEWEST] = "drop-newest",
+};
+
+int queue_init(struct queue *q, unsigned int depth, enum queue_policy policy)
+{
+	unsigned int size = 1;
+
+	if (!depth || depth > QUEUE_MAX_DEPTH)
+		return -EINVAL;
+
+	while (size < depth)
+		size <<= 1;
+
+	memset(q, 0, sizeof(*q));
+	q->depth = depth;
+	q->mask = size - 1;
+	q->policy = policy;
+	sem_init(&q->not_empty, 0, 0);
+	sem_init(&q->not_full, 0, 0);
+
+	return 0;
+}
+
+void queue_destroy(struct queue *q)
+{
+	sem_destroy(&q->not_empty);
+	sem_destroy(&q->not_full);
+}
+
+static inline
+void queue_wake(sem_t *sem, int *waits)
+{
+	if (__atomic_load_n(waits, __ATOMIC_SEQ_CST) &&
+	    __atomic_exchange_n(waits, 0, __ATOMIC_SEQ_CST))
+		sem_post(sem);
+}
+
+static inline
+void *queue_slot(struct queue *q, unsigned int idx)
+{
+	return __atomic_load_n(&q->slots[idx & q->mask], __ATOMIC_RELAXED);
+}
+
+/* consume the entry at tail unless the producer dropped it under us */
+static
+int queue_take(struct queue *q, unsigned int tail, void **it,
+	       unsigned long long *stamp)
+{
+	*it = queue_slot(q, tail);
+	*stamp = __atomic_load_n(&q->stamps[tail & q->mask], __ATOMIC_RELAXED);
+
+	return __atomic_compare_exchange_n(&q->tail, &tail, tail + 1, 0,
+					   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static
+int queue_trypop_stamp(struct queue *q, void **it, unsigned long long *stamp)
+{
+	unsigned int head, tail;
+
+	for (;;) {
+		tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		if (head == tail)
+			return -EAGAIN;
+
+		if (queue_take(q, tail, it, stamp))
+			break;
+	}
+
+	q->stats.popped++;
+	hist_record(&q->stats.wait, monotonic_nsecs() - *stamp);
+	queue_wake(&q->not_full, &q->producer_waits);
+
+	return 0;
+}
+
+int queue_trypop(struct queue *q, void **it)
+{
+	unsigned long long stamp;
+
+	return queue_trypop_stamp(q, it, &stamp);
+}
+
+int queue_pop(struct queue *q, void **it)
+{
+	unsigned long long stamp;
+	int armed = 0, slept = 0;
+
+	for (;;) {
+		if (!queue_trypop_stamp(q, it, &stamp))
+			break;
+
+		/* announce we are going to sleep, then look once more */
+		if (!armed) {
+			__atomic_store_n(&q->consumer_waits, 1, __ATOMIC_SEQ_CST);
+			armed = 1;
+			continue;
+		}
+
+		sem_wait(&q->not_empty);
+		armed = 0;
+		slept = 1;
+	}
+
+	if (armed)
+		__atomic_store_n(&q->consumer_waits, 0, __ATOMIC_RELAXED);
+
+	if (slept)
+		hist_record(&q->stats.wakeup, monotonic_nsecs() - stamp);
+
+	return 0;
+}
+
+int queue_push(struct queue *q, void *it, void **dropped)
+{
+	unsigned int head = q->head;
+	unsigned int tail, occupancy;
+	unsigned long long stamp;
+	int armed = 0;
+	void *old;
+
+	*dropped = NULL;
+
+	for (;;) {
+		tail = __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+		if (head - tail < q->depth)
+			break;
+
+		switch (q->policy) {
+		case QUEUE_DROP_NEWEST:
+			q->stats.dropped++;
+			*dropped = it;
+			return 0;
+		case QUEUE_DROP_OLDEST:
+			if (queue_take(q, tail, &old, &stamp)) {
+				q->stats.dropped++;
+				*dropped = old;
+			}
+			/* either way there is room now */
+			continue;
+		case QUEUE_BLOCK:
+			if (!armed) {
+				__atomic_store_n(&q->producer_waits, 1,
+						 __ATOMIC_SEQ_CST);
+				armed = 1;
+				continue;
+			}
+			sem_wait(&q->not_full);
+			armed = 0;
+			break;
+		}
+	}
+
+	if (armed)
+		__atomic_store_n(&q->producer_waits, 0, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&q->slots[head & q->mask], it, __ATOMIC_RELAXED);
+	__atomic_store_n(&q->stamps[head & q->mask], monotonic_nsecs(),
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_SEQ_CST);
+
+	occupancy = head + 1 - tail;
+	if (occupancy > q->stats.max_occupancy)
+		q->stats.max_occupancy = occupancy;
+	q->stats.occupancy += occupancy;
+	q->stats.pushed++;
+
+	queue_wake(&q->not_empty, &q->consumer_waits);
+
+	return 0;
+}
+
+unsigned int queue_count(struct queue *q)
+{
+	return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) -
+	       __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+}
+
+const char *queue_policy_name(enum queue_policy policy)
+{
+	return policy_names[policy];
+}
+
+int queue_policy_parse(const char *name, enum queue_policy *policy)
+{
+	unsigned int n;
+
+	for (n = 0; n < sizeof(policy_names) / sizeof(policy_names[0]); n++) {
+		if (!strcmp(name, policy_names[n])) {
+			*policy = n;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
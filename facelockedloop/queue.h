@@ -0,0 +1,68 @@
+#ifndef __QUEUE_H_
+#define __QUEUE_H_
+
+#include <semaphore.h>
+
+#include "hist.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define QUEUE_MAX_DEPTH		64
+#define QUEUE_CACHELINE		64
+
+/* what the producer does when the consumer lags behind */
+enum queue_policy {
+	QUEUE_BLOCK = 0,
+	QUEUE_DROP_OLDEST = 1,
+	QUEUE_DROP_NEWEST = 2,
+};
+
+struct queue_stats {
+	unsigned long pushed;
+	unsigned long popped;
+	unsigned long dropped;
+	/* sum of the occupancy seen on every push, for the average */
+	unsigned long occupancy;
+	unsigned int max_occupancy;
+	/* how long entries sat in the queue, recorded by the consumer */
+	struct hist wait;
+	/* from an entry being pushed to the sleeping consumer running */
+	struct hist wakeup;
+};
+
+/*
+ * single-producer/single-consumer ring: head is only written by the
+ * producer, tail by the consumer - and by the producer when it drops the
+ * oldest entry, hence the compare and swap on tail.
+ */
+struct queue {
+	unsigned int head __attribute__((aligned(QUEUE_CACHELINE)));
+	int producer_waits;
+	unsigned int tail __attribute__((aligned(QUEUE_CACHELINE)));
+	int consumer_waits;
+	void *slots[QUEUE_MAX_DEPTH] __attribute__((aligned(QUEUE_CACHELINE)));
+	unsigned long long stamps[QUEUE_MAX_DEPTH];
+	unsigned int depth;
+	unsigned int mask;
+	enum queue_policy policy;
+	sem_t not_empty;
+	sem_t not_full;
+	struct queue_stats stats;
+};
+
+int queue_init(struct queue *q, unsigned int depth, enum queue_policy policy);
+void queue_destroy(struct queue *q);
+int queue_push(struct queue *q, void *it, void **dropped);
+int queue_pop(struct queue *q, void **it);
+int queue_trypop(struct queue *q, void **it);
+unsigned int queue_count(struct queue *q);
+const char *queue_policy_name(enum queue_policy policy);
+int queue_policy_parse(const char *name, enum queue_policy *policy);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __QUEUE_H_ */
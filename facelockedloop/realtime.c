@@ -0,0 +1,258 @@
+/**
+ * @file facelockedloop/realtime.c
+ * @brief Scheduling policy, priority and cpu affinity of the stage threads.
+ *
+ * A stage is configured as <stage>:<policy>[,<priority>][@<cpus>], such
+ * as capture:fifo,80@1 or detect:other@2-3, from the command line or one
+ * per line of a file in which '#' starts a comment.
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "pipeline.h"
+#include "realtime.h"
+
+static const char *stage_names[] = {
+	[CAPTURE_STAGE] = "capture",
+	[DETECTION_STAGE] = "detect",
+	[TRACKING_STAGE] = "track",
+};
+
+static const struct {
+	const char *name;
+	int policy;
+} policies[] = {
+	{ .name = "other", .policy = SCHED_OTHER, },
+	{ .name = "fifo", .policy = SCHED_FIFO, },
+	{ .name = "rr", .policy = SCHED_RR, },
+};
+
+#define NPOLICIES	(sizeof(policies) / sizeof(policies[0]))
+#define NSTAGE_NAMES	(sizeof(stage_names) / sizeof(stage_names[0]))
+
+void realtime_defaults(struct realtime_params *rt)
+{
+	rt->policy = SCHED_OTHER;
+	rt->priority = 0;
+	rt->cpus = 0;
+}
+
+const char *realtime_policy_name(int policy)
+{
+	unsigned int n;
+
+	for (n = 0; n < NPOLICIES; n++)
+		if (policies[n].policy == policy)
+			return policies[n].name;
+
+	return "unknown";
+}
+
+static
+int realtime_stage(const char *name, size_t len, int *nth_stage)
+{
+	unsigned int n;
+	char *end;
+	long id;
+
+	for (n = 0; n < NSTAGE_NAMES; n++) {
+		if (strlen(stage_names[n]) == len &&
+		    !strncmp(name, stage_names[n], len)) {
+			*nth_stage = n;
+			return 0;
+		}
+	}
+
+	/* stages added to the pipeline go by their id */
+	id = strtol(name, &end, 10);
+	if (end == name || end != name + len || id < 0 ||
+	    id >= PIPELINE_MAX_STAGES)
+		return -EINVAL;
+	*nth_stage = id;
+
+	return 0;
+}
+
+/* a list such as 1,3-5 */
+static
+int realtime_cpus(const char *list, unsigned long *cpus)
+{
+	const char *p = list;
+	long first, last;
+	char *end;
+
+	*cpus = 0;
+	for (;;) {
+		first = strtol(p, &end, 10);
+		if (end == p)
+			return -EINVAL;
+
+		last = first;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p)
+				return -EINVAL;
+		}
+
+		if (first < 0 || last < first || last >= REALTIME_MAX_CPUS)
+			return -EINVAL;
+
+		for (; first <= last; first++)
+			*cpus |= 1UL << first;
+
+		if (*end != ',')
+			break;
+		p = end + 1;
+	}
+
+	return *end ? -EINVAL : 0;
+}
+
+int realtime_parse(const char *spec, int *nth_stage, struct realtime_params *rt)
+{
+	const char *policy, *comma, *at, *end;
+	unsigned int n;
+	size_t len;
+	char *num;
+	long prio;
+
+	policy = strchr(spec, ':');
+	if (!policy)
+		return -EINVAL;
+
+	if (realtime_stage(spec, policy - spec, nth_stage))
+		return -EINVAL;
+	policy++;
+
+	at = strchr(policy, '@');
+	end = at ? at : policy + strlen(policy);
+	comma = memchr(policy, ',', end - policy);
+	len = (comma ? comma : end) - policy;
+
+	for (n = 0; n < NPOLICIES; n++)
+		if (strlen(policies[n].name) == len &&
+		    !strncmp(policy, policies[n].name, len))
+			break;
+	if (n == NPOLICIES)
+		return -EINVAL;
+
+	realtime_defaults(rt);
+	rt->policy = policies[n].policy;
+	rt->priority = sched_get_priority_min(rt->policy);
+
+	if (comma) {
+		prio = strtol(comma + 1, &num, 10);
+		if (num == comma + 1 || num != end)
+			return -EINVAL;
+
+		if (prio < sched_get_priority_min(rt->policy) ||
+		    prio > sched_get_priority_max(rt->policy))
+			return -EINVAL;
+		rt->priority = prio;
+	}
+
+	if (at)
+		return realtime_cpus(at + 1, &rt->cpus);
+
+	return 0;
+}
+
+int realtime_apply(struct pipeline *pipe, const char *spec)
+{
+	struct realtime_params rt;
+	int nth_stage, ret;
+
+	ret = realtime_parse(spec, &nth_stage, &rt);
+	if (ret)
+		return ret;
+
+	return pipeline_set_realtime(pipe, nth_stage, &rt);
+}
+
+int realtime_load(struct pipeline *pipe, const char *path)
+{
+	char line[REALTIME_LINE_MAX], *p, *end;
+	int ret = 0, n = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		printf("error: can't open %s\n", path);
+		return -errno;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		n++;
+		p = strchr(line, '#');
+		if (p)
+			*p = '\0';
+
+		for (p = line; isspace((unsigned char) *p); p++)
+			;
+		for (end = p + strlen(p);
+		     end > p && isspace((unsigned char) end[-1]); end--)
+			;
+		*end = '\0';
+		if (!*p)
+			continue;
+
+		ret = realtime_apply(pipe, p);
+		if (ret) {
+			printf("%s:%d: bad stage scheduling '%s'\n", path, n, p);
+			break;
+		}
+	}
+	fclose(f);
+
+	return ret;
+}
+
+int realtime_attr_init(pthread_attr_t *attr, const struct realtime_params *rt)
+{
+	struct sched_param p;
+	cpu_set_t set;
+	int ret, n;
+
+	ret = pthread_attr_init(attr);
+	if (ret)
+		return -ret;
+
+	ret = pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+	if (!ret)
+		ret = pthread_attr_setschedpolicy(attr, rt->policy);
+
+	if (!ret) {
+		p.sched_priority = rt->priority;
+		ret = pthread_attr_setschedparam(attr, &p);
+	}
+
+	if (!ret && rt->cpus) {
+		CPU_ZERO(&set);
+		for (n = 0; n < REALTIME_MAX_CPUS; n++)
+			if (rt->cpus & (1UL << n))
+				CPU_SET(n, &set);
+		ret = pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+	}
+
+	if (ret) {
+		pthread_attr_destroy(attr);
+		return -ret;
+	}
+
+	return 0;
+}
+
+/* no page faults once running: everything mapped now and later stays */
+int realtime_lock_memory(void)
+{
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+		return -errno;
+
+	return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef __REALTIME_H_
+#define __REALTIME_H_
+
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define REALTIME_MAX_CPUS	(8 * (int) sizeof(unsigned long))
+#define REALTIME_LINE_MAX	128
+
+struct pipeline;
+
+/* how a stage worker runs: policy, priority and the cpus it may use */
+struct realtime_params {
+	int policy;
+	int priority;
+	/* bit n allows cpu n, none set: any cpu */
+	unsigned long cpus;
+};
+
+void realtime_defaults(struct realtime_params *rt);
+int realtime_parse(const char *spec, int *nth_stage, struct realtime_params *rt);
+int realtime_apply(struct pipeline *pipe, const char *spec);
+int realtime_load(struct pipeline *pipe, const char *path);
+int realtime_attr_init(pthread_attr_t *attr, const struct realtime_params *rt);
+const char *realtime_policy_name(int policy);
+int realtime_lock_memory(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
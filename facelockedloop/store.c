@@ -0,0 +1,124 @@
+/**
+ * @file facelockedloop/store.c
+ * @brief Detection results storage.
+ *
+ * The detector takes a slot per frame and whoever ends up with it - the
+ * tracker, or the queue when it drops it - puts it back. A slot handed
+ * to several stages is held once for each and freed by the last one.
+ */
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "store.h"
+
+int store_slab_init(struct store_slab *slab, int count)
+{
+	int n;
+
+	if (count <= 0)
+		return -EINVAL;
+
+	memset(slab, 0, sizeof(*slab));
+	slab->slots = calloc(count, sizeof(*slab->slots));
+	if (!slab->slots)
+		return -ENOMEM;
+	pthread_mutex_init(&slab->lock, NULL);
+
+	for (n = 0; n < count; n++) {
+		slab->slots[n].slab = slab;
+		slab->slots[n].next = n + 1 < count ? n + 1 : -1;
+	}
+	slab->count = count;
+	slab->free = 0;
+
+	return 0;
+}
+
+void store_slab_destroy(struct store_slab *slab)
+{
+	if (!slab->slots)
+		return;
+
+	free(slab->slots);
+	slab->slots = NULL;
+	slab->count = 0;
+	slab->free = -1;
+	pthread_mutex_destroy(&slab->lock);
+}
+
+struct store_box *store_get(struct store_slab *slab)
+{
+	struct store_slot *slot = NULL;
+
+	pthread_mutex_lock(&slab->lock);
+	if (slab->free < 0) {
+		slab->exhausted++;
+		goto done;
+	}
+
+	slot = &slab->slots[slab->free];
+	slab->free = slot->next;
+	slot->refs = 1;
+done:
+	pthread_mutex_unlock(&slab->lock);
+
+	return slot ? slot->box : NULL;
+}
+
+static inline
+struct store_slot *store_slot(struct store_box *box)
+{
+	return (struct store_slot *)((char *)box -
+				     offsetof(struct store_slot, box));
+}
+
+void store_stamp(struct store_box *box, unsigned long long birth,
+		 unsigned long long exposure)
+{
+	store_slot(box)->birth = birth;
+	store_slot(box)->exposure = exposure;
+}
+
+unsigned long long store_birth(struct store_box *box)
+{
+	return store_slot(box)->birth;
+}
+
+unsigned long long store_exposure(struct store_box *box)
+{
+	return store_slot(box)->exposure;
+}
+
+void store_set_count(struct store_box *box, int count)
+{
+	store_slot(box)->count = count;
+}
+
+int store_count(struct store_box *box)
+{
+	return store_slot(box)->count;
+}
+
+void store_hold(struct store_box *box)
+{
+	__atomic_add_fetch(&store_slot(box)->refs, 1, __ATOMIC_RELAXED);
+}
+
+void store_put(struct store_box *box)
+{
+	struct store_slot *slot;
+	struct store_slab *slab;
+
+	slot = store_slot(box);
+	slab = slot->slab;
+
+	if (__atomic_sub_fetch(&slot->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	pthread_mutex_lock(&slab->lock);
+	slot->next = slab->free;
+	slab->free = slot - slab->slots;
+	pthread_mutex_unlock(&slab->lock);
+}
@@ -6,6 +6,7 @@ extern "C" {
 #endif
   
 #include <time.h>
+#include <pthread.h>
 
 struct store_box {
 	/* if there is no coordinates, request a scan*/
@@ -15,13 +16,58 @@ struct store_box {
 	int ptA_y;
 	int ptB_x;
 	int ptB_y;
+	/* detector confidence: cascade neighbours, or follow correlation % */
+	int score;
+	/* the same face keeps its id from one frame to the next */
+	int id;
 };
 
+/* a face, and when the light it was seen by left it */
 struct facepos {
-	struct timeval timestamp;
+	/* CLOCK_MONOTONIC ns of the frame's exposure */
+	unsigned long long timestamp;
 	struct store_box box;
 };
 
+#define STORE_MAX_BOXES		8
+
+struct store_slab;
+
+/* the detection results of one frame */
+struct store_slot {
+	struct store_slab *slab;
+	int next;
+	/* one per stage the results were handed to */
+	int refs;
+	/* birth and exposure of the frame the boxes were found in */
+	unsigned long long birth;
+	unsigned long long exposure;
+	/* valid entries of box[], 0 when nothing was found */
+	int count;
+	struct store_box box[STORE_MAX_BOXES];
+};
+
+/* fixed set of result slots, handed from the detector to its consumers */
+struct store_slab {
+	struct store_slot *slots;
+	pthread_mutex_t lock;
+	unsigned long exhausted;
+	int count;
+	int free;
+};
+
+int store_slab_init(struct store_slab *slab, int count);
+void store_slab_destroy(struct store_slab *slab);
+struct store_box *store_get(struct store_slab *slab);
+void store_hold(struct store_box *box);
+void store_put(struct store_box *box);
+void store_stamp(struct store_box *box, unsigned long long birth,
+		 unsigned long long exposure);
+unsigned long long store_birth(struct store_box *box);
+unsigned long long store_exposure(struct store_box *box);
+void store_set_count(struct store_box *box, int count);
+int store_count(struct store_box *box);
+
 #ifdef __cplusplus
 }
 #endif
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <math.h>
 
 #include "kernel_utils.h"
 #include "time_utils.h"
@@ -29,8 +30,29 @@ void track_stage_up(struct stage *stg, struct stage_params *p,
 static
 void track_stage_down(struct stage *stg)
 {
+	struct tracker *t = container_of(stg, struct tracker, step);
+	double secs;
+
  	stage_down(stg);
 	pipeline_deregister(stg->pipeline, stg);
+
+	if (t->params.servos) {
+		servoio_exit();
+
+		controller_print(&t->pan_ctl, "pan");
+		controller_print(&t->tilt_ctl, "tilt");
+
+		secs = t->started ? (double) (monotonic_nsecs() - t->started) /
+			FLL_NANOSECONDS_IN_SECOND : 0;
+		printf("track: %lu corrections (%.1f/s), "
+		       "%lu detections while moving.\n", t->corrections,
+		       secs > 0 ? t->corrections / secs : 0, t->unsettled);
+		printf("track: exposure to servo command sent\n");
+		hist_print(&t->photon, "photon");
+	}
+	printf("track: %lu faces filtered, %lu missed ones coasted through, "
+	       "%lu target changes.\n", t->target.updates, t->coasted,
+	       t->target.resets + t->switches);
 }
 
 static
@@ -41,97 +63,42 @@ int track_stage_input(struct stage *stg, void **it)
 
 	stage_input(stg, &itin);
 	tracer->params.bbox  = (struct store_box*) itin;
+	stg->params.birth = store_birth(tracer->params.bbox);
 
 	return 0;
 }
 
-/**
- * the _extremely_ simple servo decision algorithms:
- */
-static
-int process_pan(int cpos, int delta, int bbox_center, int middle)
-{
-	static int last_pan_delta = 0;
-	int duty;
-
-	if ( (last_pan_delta == delta) || delta < 50)  {
-		/* motor still moving or distance not significant */
-		printf("\tkeep current\n");
-		return cpos;
-	}
-
-	last_pan_delta = delta;
-
-	switch (delta) {
-	case 51 ... 100:
-		duty = 5; break;
-	case 101 ... 200:
-		duty = 10; break;
-	case 201 ... FRAME_WIDTH/2:
-		duty = 15; break;
-	}
-
-	if (bbox_center > middle) {
-		duty = duty * (-1);
-		printf("\tback\t[%3d, %3d]\n", cpos + duty, servoio_get_position(tilt_channel));
-
-	} else
-		printf("\tforward\t[%3d, %3d]\n", cpos + duty, servoio_get_position(tilt_channel));
-
-	return cpos + duty;
-}
-
+/* the servo moves the face towards the middle of the frame */
 static
-int process_tilt(int cpos, int delta, int bbox_center, int middle)
+int next_servo_position(struct tracker *t, enum servo_type servo,
+			int bbox_center, unsigned long long now)
 {
-	static int last_tilt_delta = 0;
-	int duty;
-
-	if ((last_tilt_delta == delta) || delta < 30)  {
-		/* motor still moving or distance not significant */
-		printf("\tkeep current\n");
-		return cpos;
-	}
-
-	last_tilt_delta = delta;
-
-	switch (delta) {
-	case 31 ...  140:
-		duty = 5;
-		break;
-	case 141 ... 180:
-		duty = 10;
-		break;
-	case 181 ... FRAME_HEIGHT/2:
-		duty = 15;
-		 break;
+	struct tracker_params *p = &t->params;
+	struct controller *c;
+	int error, cpos, npos, channel;
+
+	if (servo == pan) {
+		c = &t->pan_ctl;
+		channel = p->pan_params.channel;
+		error = FRAME_WIDTH/2 - bbox_center;
+	} else {
+		c = &t->tilt_ctl;
+		channel = p->tilt_params.channel;
+		error = bbox_center - FRAME_HEIGHT/2;
 	}
 
-	if (bbox_center < middle) {
-		duty = duty * (-1);
-		printf("\tback\t[%3d, %3d]\n", servoio_get_position(pan_channel),  cpos + duty);
-	} else
-		printf("\tforward\t[%3d, %3d]\n", servoio_get_position(pan_channel),  cpos + duty);
-
-	return cpos + duty;
-}
-
-static
-int next_servo_position(enum servo_type servo, int channel, int bbox_center)
-{
-	int middle = (servo == pan) ? FRAME_WIDTH/2 : FRAME_HEIGHT/2;
-	int delta = abs(bbox_center - middle);
-	int cpos;
-
-	printf("move\t%s", (servo == pan) ? "pan" : "tilt");
 	cpos = servoio_get_position(channel);
 	if (cpos < 0)
 		return -EIO;
 
-	if (servo == pan)
-		return process_pan(cpos, delta, bbox_center, middle);
+	npos = controller_update(c, error, cpos, now);
+	if (npos == cpos)
+		printf("move\t%s\tkeep current\n", (servo == pan) ? "pan" : "tilt");
+	else
+		printf("move\t%s\t%s\t[%3d]\n", (servo == pan) ? "pan" : "tilt",
+		       npos > cpos ? "forward" : "back", npos);
 
-	return process_tilt(cpos, delta, bbox_center, middle);
+	return npos;
 }
 
 static
@@ -186,41 +153,247 @@ done:
 	return servoio_set_pulse(pan_channel, value.x);
 }
 
+/*
+ * the servo position can not be read back: a move is taken to be over
+ * once the command latency and the travel at the slew rate have elapsed.
+ */
 static
-int track_run(struct tracker *t)
+int track_move(struct tracker *t, enum servo_type servo, int channel, int npos,
+	       unsigned long long now, unsigned long long origin)
 {
 	struct tracker_params *p = &t->params;
-	int x, y, npos;
-	int ret = 0;
+	unsigned long long settle;
+	double shift;
+	int cpos;
 
-	ret = sem_trywait(&lock);
-	if (ret < 0)
+	cpos = servoio_get_position(channel);
+	if (npos == cpos)
 		return 0;
 
-	if (p->bbox->scan) {
+	settle = now + (unsigned long long) p->latency_ms * FLL_NANOSECONDS_IN_MILISECOND +
+		(unsigned long long) abs(npos - cpos) * FLL_NANOSECONDS_IN_SECOND / p->slew;
+	if (settle > t->settle)
+		t->settle = settle;
+	t->corrections++;
+
+	/* the face will be seen that much closer to the middle */
+	shift = (npos - cpos) * TRACK_PIXELS_PER_DUTY;
+	if (servo == pan)
+		kalman_shift(&t->target, shift, 0);
+	else
+		kalman_shift(&t->target, 0, -shift);
+
+	return servoio_set_pulse_at(channel, npos, origin);
+}
+
+/* the target was seen recently enough to be followed on its prediction */
+static
+int track_coasting(struct tracker *t, unsigned long long now)
+{
+	return t->target.valid && now - t->target.seen <
+		t->params.coast_ms * (unsigned long long) FLL_NANOSECONDS_IN_MILISECOND;
+}
+
+static
+int track_pick_largest(struct tracker *t, struct store_box *b, int n,
+		       unsigned long long now)
+{
+	int i, best = 0, area, most = -1;
+
+	for (i = 0; i < n; i++) {
+		area = (b[i].ptB_x - b[i].ptA_x) * (b[i].ptB_y - b[i].ptA_y);
+		if (area > most) {
+			most = area;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static
+int track_pick_centre(struct tracker *t, struct store_box *b, int n,
+		      unsigned long long now)
+{
+	int i, best = 0, dx, dy, dist, least = -1;
+
+	for (i = 0; i < n; i++) {
+		dx = bbox_center(b[i].ptB_x, b[i].ptA_x) - FRAME_WIDTH/2;
+		dy = bbox_center(b[i].ptB_y, b[i].ptA_y) - FRAME_HEIGHT/2;
+		dist = dx * dx + dy * dy;
+		if (least < 0 || dist < least) {
+			least = dist;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * the face being tracked, as long as it is around; while it is only
+ * missing the others are ignored, once it is lost the largest is taken.
+ */
+static
+int track_pick_sticky(struct tracker *t, struct store_box *b, int n,
+		      unsigned long long now)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (t->target_id && b[i].id == t->target_id)
+			return i;
+	}
+
+	if (track_coasting(t, now))
+		return -1;
+
+	return track_pick_largest(t, b, n, now);
+}
+
+static const struct track_policy {
+	const char *name;
+	/* index of the face to follow, -1: none of these */
+	int (*pick)(struct tracker *t, struct store_box *b, int n,
+		    unsigned long long now);
+} track_policies[] = {
+	[TRACK_TARGET_LARGEST] = {
+		.name = "largest",
+		.pick = track_pick_largest,
+	},
+	[TRACK_TARGET_CENTRE] = {
+		.name = "centre",
+		.pick = track_pick_centre,
+	},
+	[TRACK_TARGET_STICKY] = {
+		.name = "sticky",
+		.pick = track_pick_sticky,
+	},
+};
+
+int track_policy_parse(const char *name, enum track_target *policy)
+{
+	unsigned int n;
+
+	for (n = 0; n < sizeof(track_policies) / sizeof(track_policies[0]); n++) {
+		if (!strcmp(name, track_policies[n].name)) {
+			*policy = n;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static
+void track_set_target(struct tracker *t, int id)
+{
+	t->target_id = id;
+
+	/* the detector centres its search on the same face */
+	if (t->params.target_report)
+		__atomic_store_n(t->params.target_report, id, __ATOMIC_RELAXED);
+}
+
+/* servo io thread: the first command a frame caused is on the wire */
+static
+void track_sent(int id, unsigned long long origin, unsigned long long stamp,
+		void *arg)
+{
+	struct tracker *t = arg;
+
+	if (origin <= t->photon_origin)
+		return;
+
+	t->photon_origin = origin;
+	hist_record(&t->photon, stamp - origin);
+}
+
+static
+int track_run(struct tracker *t, unsigned long long now)
+{
+	struct tracker_params *p = &t->params;
+	struct store_box *b = p->bbox;
+	unsigned long long origin;
+	double x, y;
+	int npos, face = -1;
+	int ret = 0;
+
+	if (p->servos) {
+		ret = sem_trywait(&lock);
+		if (ret < 0)
+			return 0;
+	}
+
+	if (!b->scan)
+		face = track_policies[p->policy].pick(t, b, store_count(b), now);
+
+	if (face >= 0) {
+		b = &b[face];
+		if (b->id != t->target_id) {
+			/* somebody else: nothing known about them yet */
+			if (t->target_id)
+				t->switches++;
+			track_set_target(t, b->id);
+			kalman_reset(&t->target);
+			controller_reset(&t->pan_ctl);
+			controller_reset(&t->tilt_ctl);
+		}
+
+		/* detections are filtered at the time their frame was exposed */
+		t->face.box = *b;
+		t->face.timestamp = store_exposure(p->bbox);
+		if (!t->face.timestamp)
+			t->face.timestamp = now;
+		kalman_update(&t->target, bbox_center(b->ptB_x, b->ptA_x),
+			      bbox_center(b->ptB_y, b->ptA_y),
+			      b->ptB_x - b->ptA_x, t->face.timestamp);
+	} else if (track_coasting(t, now)) {
+		/* a missed detection: keep following where the face should be */
+		t->coasted++;
+	} else {
 		/* if a face was not detected after SCAN_WAIT_PERIOD, we initiate a
 		 *  camera scan sequence looking for targets: the camera will
-		 *  autonomously move to the left and right
+		 *  autonomously move to the left and right, slowly enough for
+		 *  the detector to catch a face on the way.
 		 */
-		ret = scan_for_targets(p);
+		if (p->servos && now >= t->scan_next) {
+			t->scan_next = now + TRACK_SCAN_INTERVAL_MS *
+				(unsigned long long) FLL_NANOSECONDS_IN_MILISECOND;
+			ret = scan_for_targets(p);
+		}
+		/* a face found again is a new target */
+		track_set_target(t, 0);
+		kalman_reset(&t->target);
+		controller_reset(&t->pan_ctl);
+		controller_reset(&t->tilt_ctl);
 		goto done;
 	}
 
-	/* a face was detected, now track it so it remains at the center of the screen */
-	x = bbox_center(p->bbox->ptB_x, p->bbox->ptA_x);
-	npos = next_servo_position(pan, p->pan_params.channel, x);
-	ret = servoio_set_pulse(p->pan_params.channel, npos);
-	if (ret < 0)
+	if (!p->servos)
 		goto done;
 
-	y = bbox_center(p->bbox->ptB_y, p->bbox->ptA_y);
-	npos = next_servo_position(tilt, p->tilt_params.channel, y);
-	ret = servoio_set_pulse(p->tilt_params.channel, npos);
+	/* track the face so it remains at the center of the screen */
+	kalman_position(&t->target, now, &x, &y);
+	npos = next_servo_position(t, pan, lround(x), now);
+	if (npos < 0) {
+		ret = npos;
+		goto done;
+	}
+	origin = face >= 0 ? t->face.timestamp : 0;
+	ret = track_move(t, pan, p->pan_params.channel, npos, now, origin);
 	if (ret < 0)
 		goto done;
+
+	npos = next_servo_position(t, tilt, lround(y), now);
+	if (npos < 0) {
+		ret = npos;
+		goto done;
+	}
+	ret = track_move(t, tilt, p->tilt_params.channel, npos, now, origin);
 done:
-	free(p->bbox);
-	sem_post(&lock);
+	if (p->servos)
+		sem_post(&lock);
 
 	return ret;
 }
@@ -229,36 +402,37 @@ static
 int track_stage_run(struct stage *stg)
 {
 	struct tracker *tracer = container_of(stg, struct tracker, step);
-	static long last = 0;
-	struct timespec spec;
-	long current;
+	unsigned long long now, taken;
+	int ret = 0;
 
 	if (!tracer)
 		return -EINVAL;
 
-	/* 650 msecs between motor moves:
-	 *
-	 * IMPORTANT
-	 * ---------
-	 *
-	 *  This value is a physical limit:
-	 *       - latency from motor request to pwm signal reaching the motor
-	 *       - latency for motor to reach its final position
-	 * This is required because we dont have a mechanism to read the motor
-	 * position with precision.
-	 *
-	 * This makes the video display lag but unfortunately cant do any better
-	 * with GPIO based PWM and slow motors
-	 *
+	now = monotonic_nsecs();
+	if (!tracer->started)
+		tracer->started = now;
+
+	/*
+	 * a frame taken while the camera moves sees the face where it no
+	 * longer is, however late its detection gets here: only frames
+	 * exposed once the last move has settled are looked at.
 	 */
-	clock_gettime(CLOCK_REALTIME, &spec);
-	current = timespec_msecs(&spec);
-	if (current < last)
-		return 0;
+	taken = store_exposure(tracer->params.bbox);
+	if (!taken)
+		taken = now;
 
-	last = timespec_msecs(&spec) + 650;
+	if (taken < tracer->settle) {
+		tracer->unsettled++;
+		goto done;
+	}
+
+	ret = track_run(tracer, now);
+done:
+	/* the tracker is the last owner of the detection results */
+	store_put(tracer->params.bbox);
+	tracer->params.bbox = NULL;
 
-	return track_run(tracer);
+	return ret;
 }
 
 static
@@ -324,32 +498,6 @@ void *servo_ctrl(void *cookie)
 	return NULL;
 }
 
-static
-int setup_sched_parameters(pthread_attr_t *attr, int prio)
-{
-	struct sched_param p;
-	int ret;
-
-	ret = pthread_attr_init(attr);
-	if (ret)
-		return -1;
-
-	ret = pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
-	if (ret)
-		return -1;
-
-	ret = pthread_attr_setschedpolicy(attr, prio ? SCHED_FIFO : SCHED_OTHER);
-	if (ret)
-		return -1;
-
-	p.sched_priority = prio;
-	ret = pthread_attr_setschedparam(attr, &p);
-	if (ret)
-		return -1;
-
-	return 0;
-}
-
 static
 struct stage_ops track_ops = {
 	.input = track_stage_input,
@@ -365,18 +513,55 @@ int track_initialize(struct tracker *t, struct tracker_params *p, struct pipelin
 {
   	struct stage_params stgparams = {
 		.nth_stage = TRACKING_STAGE,
+		.upstream = DETECTION_STAGE,
 		.data_in = NULL,
 		.data_out = NULL,
 	};
 	pthread_attr_t tattr;
+	struct realtime_params rt;
+	struct controller_params ctl;
 	pthread_t ctrl;
 	int ret;
 
-	ret = servoio_init();
+	if (p->slew <= 0 || p->latency_ms < 0)
+		return -EINVAL;
+
+	t->settle = 0;
+	t->scan_next = 0;
+	t->started = 0;
+	t->corrections = 0;
+	t->unsettled = 0;
+	t->coasted = 0;
+	t->target_id = 0;
+	t->switches = 0;
+	memset(&t->face, 0, sizeof(t->face));
+	hist_reset(&t->photon);
+	t->photon_origin = 0;
+	kalman_reset(&t->target);
+	t->target.updates = 0;
+	t->target.resets = 0;
+
+	ctl = p->controller;
+	ctl.deadband = TRACK_PAN_DEADBAND;
+	ret = controller_init(&t->pan_ctl, &ctl);
+	if (ret)
+		return ret;
+
+	ctl.deadband = TRACK_TILT_DEADBAND;
+	ret = controller_init(&t->tilt_ctl, &ctl);
+	if (ret)
+		return ret;
+
+	t->params = *p;
+	if (!p->servos)
+		goto up;
+
+	ret = servoio_init(p->protocol);
 	if (ret) {
 		printf("failed to initialize the servo io\n");
 		return -EIO;
 	}
+	servoio_notify(track_sent, t);
 
 	ret = sem_init(&lock, 0, 1);
 	if (ret < 0) {
@@ -384,7 +569,8 @@ int track_initialize(struct tracker *t, struct tracker_params *p, struct pipelin
 		return -EIO;
 	}
 
-	ret = setup_sched_parameters(&tattr, 0);
+	realtime_defaults(&rt);
+	ret = realtime_attr_init(&tattr, &rt);
 	if (ret) {
 		printf("track: failed to set control task attr\n");
 		return -EIO;
@@ -398,8 +584,7 @@ int track_initialize(struct tracker *t, struct tracker_params *p, struct pipelin
 		printf("track: failed to create control task\n");
 		return -EIO;
 	}
-
-	t->params = *p;
+up:
 	track_stage_up(&t->step, &stgparams, &track_ops, pipe);
 
 	return ret;
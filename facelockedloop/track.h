@@ -2,6 +2,8 @@
 #define __TRACK_H_
 
 #include "pipeline.h"
+#include "control.h"
+#include "kalman.h"
 #include "servolib.h"
 #include "store.h"
 
@@ -9,21 +11,72 @@
 extern "C" {
 #endif
 
+/* pixels off the middle the servos ignore */
+#define TRACK_PAN_DEADBAND	50
+#define TRACK_TILT_DEADBAND	30
+
+/* servo motion model: duty per second, and command to motion latency */
+#define TRACK_SLEW		100
+#define TRACK_LATENCY_MS	50
+/* image shift of one duty of camera motion: 2 degrees, 60 over 640 px */
+#define TRACK_PIXELS_PER_DUTY	21.3
+/* how long a face missing from the detections is still followed */
+#define TRACK_COAST_MS		1000
+/* one search step every so often */
+#define TRACK_SCAN_INTERVAL_MS	650
+
+/* which of the faces found is followed */
+enum track_target {
+	TRACK_TARGET_LARGEST = 0,
+	TRACK_TARGET_CENTRE = 1,
+	/* the same face for as long as it is around */
+	TRACK_TARGET_STICKY = 2,
+};
+
 struct tracker_params {
 	int dev;
 	int pan_tgt;
 	int tilt_tgt;
 	struct servo_params pan_params;
 	struct servo_params tilt_params;
+	enum servoio_protocol protocol;
+	struct controller_params controller;
+	int slew;
+	int latency_ms;
+	int coast_ms;
+	enum track_target policy;
+	/* 0: the servos belong to another camera, only follow the faces */
+	int servos;
+	/* where the id of the followed face is told upstream, or NULL */
+	int *target_report;
 	struct store_box *bbox;
 };
 
 struct tracker {
 	struct stage step;
 	struct tracker_params params;
+	struct controller pan_ctl;
+	struct controller tilt_ctl;
+	/* when the last commanded move is expected to be over */
+	unsigned long long settle;
+	unsigned long long scan_next;
+	unsigned long long started;
+	unsigned long corrections;
+	unsigned long unsettled;
+	struct kalman_target target;
+	/* the last detection of the target */
+	struct facepos face;
+	/* frame exposure to the first servo command it caused going out */
+	struct hist photon;
+	/* the last frame accounted in photon, servo io thread only */
+	unsigned long long photon_origin;
+	unsigned long coasted;
+	int target_id;
+	unsigned long switches;
 	int status;
 };
 
+int track_policy_parse(const char *name, enum track_target *policy);
 int track_initialize(struct tracker *t, struct tracker_params *p, struct pipeline *pipe);
 
 #ifdef __cplusplus
@@ -0,0 +1,250 @@
+/**
+ * @file facelockedloop/v4l2cam.c
+ * @brief V4L2 capture straight from the driver's buffers.
+ *
+ * The camera streams YUYV or GREY into buffers mapped from the driver;
+ * a buffer is handed out as is and only given back once every stage is
+ * done with it. Nothing is converted on the way in.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+
+#include "v4l2cam.h"
+
+static
+int v4l2cam_ioctl(int fd, unsigned long request, void *arg)
+{
+	int ret;
+
+	do {
+		ret = ioctl(fd, request, arg);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret < 0 ? -errno : 0;
+}
+
+static
+int v4l2cam_format(struct v4l2cam *c, int width, int height)
+{
+	static const unsigned int formats[] = {
+		[V4L2CAM_YUYV] = V4L2_PIX_FMT_YUYV,
+		[V4L2CAM_GREY] = V4L2_PIX_FMT_GREY,
+	};
+	struct v4l2_format fmt;
+	unsigned int n;
+
+	for (n = 0; n < sizeof(formats) / sizeof(formats[0]); n++) {
+		memset(&fmt, 0, sizeof(fmt));
+		fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		fmt.fmt.pix.width = width;
+		fmt.fmt.pix.height = height;
+		fmt.fmt.pix.pixelformat = formats[n];
+		fmt.fmt.pix.field = V4L2_FIELD_NONE;
+
+		if (v4l2cam_ioctl(c->fd, VIDIOC_S_FMT, &fmt))
+			continue;
+
+		/* the driver may have settled for something else */
+		if (fmt.fmt.pix.pixelformat != formats[n])
+			continue;
+
+		c->format = n;
+		c->width = fmt.fmt.pix.width;
+		c->height = fmt.fmt.pix.height;
+		c->bytesperline = fmt.fmt.pix.bytesperline;
+		if (!c->bytesperline)
+			c->bytesperline = c->width * (n == V4L2CAM_YUYV ? 2 : 1);
+
+		return 0;
+	}
+
+	return -ENOTSUP;
+}
+
+static
+void v4l2cam_rate(struct v4l2cam *c, int fps)
+{
+	struct v4l2_streamparm parm;
+
+	memset(&parm, 0, sizeof(parm));
+	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	parm.parm.capture.timeperframe.numerator = 1;
+	parm.parm.capture.timeperframe.denominator = fps;
+
+	/* not every driver lets the rate be chosen */
+	v4l2cam_ioctl(c->fd, VIDIOC_S_PARM, &parm);
+}
+
+static
+int v4l2cam_map_buffers(struct v4l2cam *c, int nbufs)
+{
+	struct v4l2_requestbuffers req;
+	struct v4l2_buffer buf;
+	int ret, n;
+
+	memset(&req, 0, sizeof(req));
+	req.count = nbufs < V4L2CAM_MAX_BUFFERS ? nbufs : V4L2CAM_MAX_BUFFERS;
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+
+	ret = v4l2cam_ioctl(c->fd, VIDIOC_REQBUFS, &req);
+	if (ret)
+		return ret;
+
+	if (req.count < 2 || req.count > V4L2CAM_MAX_BUFFERS)
+		return -ENOMEM;
+
+	for (n = 0; n < (int) req.count; n++) {
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = n;
+
+		ret = v4l2cam_ioctl(c->fd, VIDIOC_QUERYBUF, &buf);
+		if (ret)
+			return ret;
+
+		c->maps[n].start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE,
+					MAP_SHARED, c->fd, buf.m.offset);
+		if (c->maps[n].start == MAP_FAILED) {
+			c->maps[n].start = NULL;
+			return -errno;
+		}
+		c->maps[n].length = buf.length;
+		c->nbufs++;
+	}
+
+	return 0;
+}
+
+int v4l2cam_open(struct v4l2cam *c, const char *dev, int width, int height,
+		 int fps, int nbufs)
+{
+	struct v4l2_capability cap;
+	int ret;
+
+	memset(c, 0, sizeof(*c));
+	c->fd = open(dev, O_RDWR | O_CLOEXEC);
+	if (c->fd < 0)
+		return -errno;
+
+	ret = v4l2cam_ioctl(c->fd, VIDIOC_QUERYCAP, &cap);
+	if (ret)
+		goto error;
+
+	if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) ||
+	    !(cap.capabilities & V4L2_CAP_STREAMING)) {
+		ret = -ENODEV;
+		goto error;
+	}
+
+	ret = v4l2cam_format(c, width, height);
+	if (ret) {
+		printf("v4l2: %s delivers neither YUYV nor GREY\n", dev);
+		goto error;
+	}
+
+	v4l2cam_rate(c, fps);
+
+	ret = v4l2cam_map_buffers(c, nbufs);
+	if (ret)
+		goto error;
+
+	printf("v4l2: %s, %dx%d %s, %d buffers\n", dev, c->width, c->height,
+	       c->format == V4L2CAM_YUYV ? "YUYV" : "GREY", c->nbufs);
+
+	return 0;
+error:
+	v4l2cam_close(c);
+
+	return ret;
+}
+
+int v4l2cam_queue(struct v4l2cam *c, int index)
+{
+	struct v4l2_buffer buf;
+
+	memset(&buf, 0, sizeof(buf));
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = index;
+
+	return v4l2cam_ioctl(c->fd, VIDIOC_QBUF, &buf);
+}
+
+int v4l2cam_start(struct v4l2cam *c)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	int ret, n;
+
+	for (n = 0; n < c->nbufs; n++) {
+		ret = v4l2cam_queue(c, n);
+		if (ret)
+			return ret;
+	}
+
+	ret = v4l2cam_ioctl(c->fd, VIDIOC_STREAMON, &type);
+	if (!ret)
+		c->streaming = 1;
+
+	return ret;
+}
+
+/*
+ * blocks for the next filled buffer, which then belongs to the caller;
+ * stamp is when the driver filled it, CLOCK_MONOTONIC ns, 0 if unknown.
+ */
+int v4l2cam_dequeue(struct v4l2cam *c, int *index, unsigned long long *stamp)
+{
+	struct v4l2_buffer buf;
+	int ret;
+
+	memset(&buf, 0, sizeof(buf));
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+
+	ret = v4l2cam_ioctl(c->fd, VIDIOC_DQBUF, &buf);
+	if (ret)
+		return ret;
+
+	/* frames the driver had no buffer for */
+	if (c->sequence && buf.sequence > c->sequence + 1)
+		c->lost += buf.sequence - c->sequence - 1;
+	c->sequence = buf.sequence;
+
+	*stamp = 0;
+	if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+	    V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+		*stamp = (unsigned long long) buf.timestamp.tv_sec * 1000000000ULL +
+			buf.timestamp.tv_usec * 1000ULL;
+
+	*index = buf.index;
+
+	return 0;
+}
+
+void v4l2cam_close(struct v4l2cam *c)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	int n;
+
+	if (c->fd < 0)
+		return;
+
+	if (c->streaming)
+		v4l2cam_ioctl(c->fd, VIDIOC_STREAMOFF, &type);
+	c->streaming = 0;
+
+	for (n = 0; n < c->nbufs; n++)
+		munmap(c->maps[n].start, c->maps[n].length);
+	c->nbufs = 0;
+
+	close(c->fd);
+	c->fd = -1;
+}
@@ -0,0 +1,48 @@
+#ifndef __V4L2CAM_H_
+#define __V4L2CAM_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define V4L2CAM_MAX_BUFFERS	32
+
+/* what the camera delivers, only luma bearing formats are taken */
+enum v4l2cam_format {
+	V4L2CAM_YUYV = 0,
+	V4L2CAM_GREY = 1,
+};
+
+struct v4l2cam_map {
+	void *start;
+	size_t length;
+};
+
+/* a V4L2 capture device streaming into mmap'd driver buffers */
+struct v4l2cam {
+	int fd;
+	struct v4l2cam_map maps[V4L2CAM_MAX_BUFFERS];
+	int nbufs;
+	int width;
+	int height;
+	int bytesperline;
+	enum v4l2cam_format format;
+	int streaming;
+	unsigned long sequence;
+	unsigned long lost;
+};
+
+int v4l2cam_open(struct v4l2cam *c, const char *dev, int width, int height,
+		 int fps, int nbufs);
+int v4l2cam_start(struct v4l2cam *c);
+int v4l2cam_dequeue(struct v4l2cam *c, int *index, unsigned long long *stamp);
+int v4l2cam_queue(struct v4l2cam *c, int index);
+void v4l2cam_close(struct v4l2cam *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,9 +1,19 @@
 #ifndef __SERVOLIB_H_
 #define __SERVOLIB_H_
 
+#include <stdint.h>
+
 #define MAX_DUTY	95
 #define MIN_DUTY	5
 
+#define SERVOIO_CHANNELS	2
+
+/* where the servos listen, and the duty they start at */
+#define SERVOIO_PAN_PORT	55555
+#define SERVOIO_TILT_PORT	55556
+#define SERVOIO_PAN_HOME	50
+#define SERVOIO_TILT_HOME	MIN_DUTY
+
 struct servo_params {
 	int channel;
 	int position;
@@ -22,9 +32,40 @@ extern "C" {
 enum servo_channel {pan_channel = 1, tilt_channel = 0};
 enum servo_type	{pan = 1, tilt = 0};
 
+enum servoio_protocol {
+	/* one ASCII duty per datagram, one port per channel */
+	SERVOIO_ASCII = 0,
+	/* every channel in one binary datagram, see servoio_batch */
+	SERVOIO_BATCH = 1,
+};
+
+#define SERVOIO_BATCH_MAGIC	0x46534231	/* "FSB1" */
+
+/*
+ * batch datagram, all fields in network byte order: the duty of every
+ * channel, indexed by channel, stamped with the sender's CLOCK_MONOTONIC
+ * time of the newest command in it.
+ */
+struct servoio_batch {
+	uint32_t magic;
+	uint32_t seq;
+	uint64_t timestamp;
+	uint8_t count;
+	uint8_t duty[SERVOIO_CHANNELS];
+} __attribute__((packed));
+
+/* queues the pulse, the servo io thread sends it */
 int servoio_set_pulse(int id, int value);
+/* same, for a pulse answering what was seen at origin (CLOCK_MONOTONIC ns) */
+int servoio_set_pulse_at(int id, int value, unsigned long long origin);
+/* sent() runs on the io thread once a pulse with an origin has gone out */
+void servoio_notify(void (*sent)(int id, unsigned long long origin,
+				 unsigned long long stamp, void *arg),
+		    void *arg);
+/* last pulse queued, no io */
 int servoio_get_position(int id);
-int servoio_init(void);
+int servoio_init(enum servoio_protocol protocol);
+void servoio_exit(void);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,56 @@
+#ifndef __SERVOSIM_H_
+#define __SERVOSIM_H_
+
+#include <stdint.h>
+
+#include "servolib.h"
+
+#define SERVOSIM_SHM		"/fll-servosim"
+#define SERVOSIM_MAGIC		0x4d495346	/* "FSIM" */
+
+/* duty to angle: the home duty looks straight ahead */
+#define SERVOSIM_DEG_PER_DUTY	2.0
+
+struct servosim_axis {
+	/* duty units, fractional while slewing */
+	double position;
+	double target;
+	int home;
+	uint64_t commands;
+};
+
+/*
+ * published by the simulator in shared memory; seq is odd while an
+ * update is in progress, readers retry until they see the same even value
+ * before and after copying.
+ */
+struct servosim_state {
+	uint32_t magic;
+	uint32_t seq;
+	/* CLOCK_MONOTONIC ns of the last update */
+	uint64_t updated;
+	double slew;
+	double latency_ms;
+	struct servosim_axis axis[SERVOIO_CHANNELS];
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct servosim_state *servosim_map(int create);
+void servosim_unmap(struct servosim_state *s);
+int servosim_read(const struct servosim_state *s, struct servosim_state *copy);
+void servosim_begin(struct servosim_state *s);
+void servosim_end(struct servosim_state *s);
+
+static inline double servosim_angle(const struct servosim_axis *a)
+{
+	return (a->position - a->home) * SERVOSIM_DEG_PER_DUTY;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -115,5 +115,15 @@ static inline unsigned long timespec_msecs(struct timespec *t)
 		t->tv_nsec / FLL_NANOSECONDS_IN_MILISECOND);
 }
 
+static inline unsigned long long monotonic_nsecs(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (unsigned long long) t.tv_sec * FLL_NANOSECONDS_IN_SECOND +
+		t.tv_nsec;
+}
+
 
 #endif
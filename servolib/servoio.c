@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -9,10 +11,26 @@
 #include <unistd.h>
 #include <errno.h>
 #include <netdb.h>
+#include <endian.h>
 
 #include "kernel_utils.h"
+#include "time_utils.h"
 #include "servolib.h"
 
+/*
+ * Commands are not sent by the caller: set_pulse only records the new
+ * target and wakes the io thread, which sends the latest target of every
+ * channel no sooner than SERVOIO_INTERVAL_US after the previous one.
+ * Targets set in between replace each other.
+ *
+ * In batch mode all channels go out together, in one servoio_batch
+ * datagram, to every distinct channel endpoint with a single sendmmsg().
+ *
+ * A pulse may carry the time of what it answers: once its command is
+ * out, the notify hook gets that origin along with the time it was sent.
+ */
+#define SERVOIO_INTERVAL_US	15000
+
 static int sockfd = -1;
 
 static struct ip_servo {
@@ -21,34 +39,65 @@ static struct ip_servo {
 	char *hostname;
 	char *name;
 	int port;
+	/* last commanded, what get_position reports */
 	int duty;
+	/* what the pending duty answers, 0 if nothing in particular */
+	unsigned long long origin;
 	int calibration_step;
+	/* the io thread's side */
+	struct timespec next;
+	unsigned long sent;
+	unsigned long coalesced;
 } server[] = {
 	[pan_channel] = {
 		/* db410c: gpio 36 (0 on Mezanine board) */
 		.name = "pan servo",
 		.hostname = "127.0.0.1",
 		.calibration_step = 2,
-		.port = 55555,
-		.duty = 50,
+		.port = SERVOIO_PAN_PORT,
+		.duty = SERVOIO_PAN_HOME,
 	},
 	[tilt_channel] = {
 		/* db410c: gpio 13 (1 on Mezanine board) */
 		.name = "tilt_servo",
 		.hostname = "127.0.0.1",
 		.calibration_step = 2,
-		.port = 55556,
-		.duty = MIN_DUTY,
+		.port = SERVOIO_TILT_PORT,
+		.duty = SERVOIO_TILT_HOME,
 	}
 };
 
-int servoio_set_pulse(int id, int duty)
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* one bit per channel with a target not sent yet */
+	unsigned int pending;
+	enum servoio_protocol protocol;
+	/* batch mode */
+	struct mmsghdr msgs[SERVOIO_CHANNELS];
+	struct iovec iov;
+	struct servoio_batch batch;
+	struct timespec next;
+	unsigned long long stamp;
+	unsigned long batches;
+	/* told of the origin of every pulse once sent */
+	void (*sent)(int id, unsigned long long origin,
+		     unsigned long long stamp, void *arg);
+	void *arg;
+	int nendpoints;
+	int error;
+	int quit;
+	int running;
+} io = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+int servoio_set_pulse_at(int id, int duty, unsigned long long origin)
 {
-	char buf[10];
-	int serverlen;
-	int n;
+	int ret;
 
-	if (sockfd < 0 || id >= 2)
+	if (sockfd < 0 || id < 0 || id >= SERVOIO_CHANNELS)
 		return -EIO;
 
 	if (duty > MAX_DUTY)
@@ -57,21 +106,36 @@ int servoio_set_pulse(int id, int duty)
 	if (duty < MIN_DUTY)
 		duty = MIN_DUTY;
 
-	serverlen = sizeof(server[id].serveraddr);
-	snprintf(buf, sizeof(buf), "%d", duty);
-	n = sendto(sockfd,
-		buf,
-		strlen(buf),
-		0,
-		(struct sockaddr*) &server[id].serveraddr,
-		serverlen);
-	if (n < 0)
-		return -EIO;
+	pthread_mutex_lock(&io.lock);
+	if (io.pending & (1 << id))
+		server[id].coalesced++;
+	__atomic_store_n(&server[id].duty, duty, __ATOMIC_RELAXED);
+	server[id].origin = origin;
+	io.pending |= 1 << id;
+	io.stamp = monotonic_nsecs();
+	pthread_cond_signal(&io.cond);
 
-	usleep(15000);
-	server[id].duty = duty;
+	/* a failed send is reported to the next caller */
+	ret = io.error;
+	io.error = 0;
+	pthread_mutex_unlock(&io.lock);
 
-	return 0;
+	return ret;
+}
+
+int servoio_set_pulse(int id, int duty)
+{
+	return servoio_set_pulse_at(id, duty, 0);
+}
+
+void servoio_notify(void (*sent)(int id, unsigned long long origin,
+				 unsigned long long stamp, void *arg),
+		    void *arg)
+{
+	pthread_mutex_lock(&io.lock);
+	io.sent = sent;
+	io.arg = arg;
+	pthread_mutex_unlock(&io.lock);
 }
 
 int servoio_get_position(int id)
@@ -79,15 +143,212 @@ int servoio_get_position(int id)
 	if (sockfd < 0)
 		return -EINVAL;
 
-	if (id >= 2)
+	if (id < 0 || id >= SERVOIO_CHANNELS)
 		return -EINVAL;
 
-	usleep(15000);
-	return 	server[id].duty;
+	return __atomic_load_n(&server[id].duty, __ATOMIC_RELAXED);
+}
+
+static
+int servoio_send(int id, int duty)
+{
+	char buf[10];
+	int n;
+
+	snprintf(buf, sizeof(buf), "%d", duty);
+	n = sendto(sockfd, buf, strlen(buf), 0,
+		   (struct sockaddr*) &server[id].serveraddr,
+		   sizeof(server[id].serveraddr));
+
+	return n < 0 ? -EIO : 0;
+}
+
+static
+int servoio_send_batch(unsigned long long stamp)
+{
+	int id, n;
+
+	io.batch.magic = htonl(SERVOIO_BATCH_MAGIC);
+	io.batch.seq = htonl(io.batches);
+	io.batch.timestamp = htobe64(stamp);
+	io.batch.count = SERVOIO_CHANNELS;
+	for (id = 0; id < SERVOIO_CHANNELS; id++) {
+		io.batch.duty[id] = __atomic_load_n(&server[id].duty,
+						    __ATOMIC_RELAXED);
+		server[id].sent++;
+	}
+
+	n = sendmmsg(sockfd, io.msgs, io.nendpoints, 0);
+	io.batches++;
+
+	return n == io.nendpoints ? 0 : -EIO;
+}
+
+/* io thread, unlocked: the command carrying these origins just went out */
+static
+void servoio_sent(const unsigned long long *origin,
+		  void (*sent)(int, unsigned long long, unsigned long long,
+			       void *), void *arg)
+{
+	unsigned long long stamp = monotonic_nsecs();
+	int id;
+
+	for (id = 0; id < SERVOIO_CHANNELS; id++)
+		if (origin[id])
+			sent(id, origin[id], stamp, arg);
+}
+
+static
+int servoio_due(const struct timespec *next, const struct timespec *now)
+{
+	return now->tv_sec > next->tv_sec ||
+		(now->tv_sec == next->tv_sec && now->tv_nsec >= next->tv_nsec);
 }
 
-int servoio_init(void)
+/* channels share one pacing deadline, the batch carries them all */
+static
+void servoio_run_batch(struct timespec *now, struct timespec *interval)
 {
+	unsigned long long stamp, origin[SERVOIO_CHANNELS];
+	void (*sent)(int, unsigned long long, unsigned long long, void *);
+	void *arg;
+	int id, ret;
+
+	if (!servoio_due(&io.next, now)) {
+		pthread_cond_timedwait(&io.cond, &io.lock, &io.next);
+		return;
+	}
+
+	io.pending = 0;
+	for (id = 0; id < SERVOIO_CHANNELS; id++) {
+		origin[id] = server[id].origin;
+		server[id].origin = 0;
+	}
+	stamp = io.stamp;
+	sent = io.sent;
+	arg = io.arg;
+	pthread_mutex_unlock(&io.lock);
+
+	ret = servoio_send_batch(stamp);
+	if (!ret && sent)
+		servoio_sent(origin, sent, arg);
+
+	io.next = *now;
+	timespec_add(&io.next, interval);
+
+	pthread_mutex_lock(&io.lock);
+	if (ret)
+		io.error = ret;
+}
+
+static
+void *servoio_thread(void *arg)
+{
+	void (*sent)(int, unsigned long long, unsigned long long, void *);
+	struct timespec now, interval, wake;
+	unsigned long long origin;
+	int id, duty, ret, ready;
+	void *data;
+
+	interval.tv_sec = 0;
+	interval.tv_nsec = SERVOIO_INTERVAL_US * FLL_NANOSECONDS_IN_MICROSECOND;
+
+	pthread_mutex_lock(&io.lock);
+	for (;;) {
+		while (!io.pending && !io.quit)
+			pthread_cond_wait(&io.cond, &io.lock);
+
+		if (io.quit)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (io.protocol == SERVOIO_BATCH) {
+			servoio_run_batch(&now, &interval);
+			continue;
+		}
+
+		for (id = 0, ready = -1; id < SERVOIO_CHANNELS; id++) {
+			if ((io.pending & (1 << id)) &&
+			    servoio_due(&server[id].next, &now)) {
+				ready = id;
+				break;
+			}
+		}
+
+		if (ready < 0) {
+			/* everything pending is paced: sleep until the first is due */
+			for (id = 0; id < SERVOIO_CHANNELS; id++) {
+				if (!(io.pending & (1 << id)))
+					continue;
+				if (ready < 0 || servoio_due(&server[id].next, &wake)) {
+					wake = server[id].next;
+					ready = id;
+				}
+			}
+			pthread_cond_timedwait(&io.cond, &io.lock, &wake);
+			continue;
+		}
+
+		id = ready;
+		io.pending &= ~(1 << id);
+		duty = __atomic_load_n(&server[id].duty, __ATOMIC_RELAXED);
+		origin = server[id].origin;
+		server[id].origin = 0;
+		sent = io.sent;
+		data = io.arg;
+		pthread_mutex_unlock(&io.lock);
+
+		ret = servoio_send(id, duty);
+		if (!ret && sent && origin)
+			sent(id, origin, monotonic_nsecs(), data);
+
+		server[id].next = now;
+		timespec_add(&server[id].next, &interval);
+		server[id].sent++;
+
+		pthread_mutex_lock(&io.lock);
+		if (ret)
+			io.error = ret;
+	}
+	pthread_mutex_unlock(&io.lock);
+
+	return NULL;
+}
+
+/* one message per distinct channel address, all pointing at the batch */
+static
+void servoio_batch_endpoints(void)
+{
+	struct sockaddr_in *a, *b;
+	int i, j;
+
+	io.iov.iov_base = &io.batch;
+	io.iov.iov_len = sizeof(io.batch);
+	io.nendpoints = 0;
+
+	for (i = 0; i < SERVOIO_CHANNELS; i++) {
+		a = &server[i].serveraddr;
+		for (j = 0; j < i; j++) {
+			b = &server[j].serveraddr;
+			if (a->sin_addr.s_addr == b->sin_addr.s_addr &&
+			    a->sin_port == b->sin_port)
+				break;
+		}
+		if (j < i)
+			continue;
+
+		memset(&io.msgs[io.nendpoints], 0, sizeof(io.msgs[0]));
+		io.msgs[io.nendpoints].msg_hdr.msg_name = a;
+		io.msgs[io.nendpoints].msg_hdr.msg_namelen = sizeof(*a);
+		io.msgs[io.nendpoints].msg_hdr.msg_iov = &io.iov;
+		io.msgs[io.nendpoints].msg_hdr.msg_iovlen = 1;
+		io.nendpoints++;
+	}
+}
+
+int servoio_init(enum servoio_protocol protocol)
+{
+	pthread_condattr_t attr;
 	int i, ret;
 
 	sockfd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -96,7 +357,7 @@ int servoio_init(void)
 		return -EIO;
 	}
 
-	for (i = 0; i < 2; i++) {
+	for (i = 0; i < SERVOIO_CHANNELS; i++) {
 		server[i].host = gethostbyname(server[i].hostname);
 		if (server[i].host == NULL) {
 			printf("ERROR, no such host as %s\n", server[i].hostname);
@@ -106,7 +367,27 @@ int servoio_init(void)
 		bcopy((char *) server[i].host->h_addr, (char *) &server[i].serveraddr.sin_addr.s_addr, server[i].host->h_length);
 		server[i].serveraddr.sin_port = htons(server[i].port);
 		server[i].serveraddr.sin_family = AF_INET;
+	}
+
+	io.protocol = protocol;
+	if (protocol == SERVOIO_BATCH)
+		servoio_batch_endpoints();
+
+	/* the pacing deadlines are on the monotonic clock */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&io.cond, &attr);
+	pthread_condattr_destroy(&attr);
 
+	io.quit = 0;
+	ret = pthread_create(&io.thread, NULL, servoio_thread, NULL);
+	if (ret) {
+		printf("ERROR creating the servo io thread\n");
+		return -ret;
+	}
+	io.running = 1;
+
+	for (i = 0; i < SERVOIO_CHANNELS; i++) {
 		ret = servoio_set_pulse(i, server[i].duty);
 		if (ret < 0)
 			return -EIO;
@@ -115,3 +396,31 @@ int servoio_init(void)
 	return 0;
 }
 
+void servoio_exit(void)
+{
+	int i;
+
+	if (io.running) {
+		pthread_mutex_lock(&io.lock);
+		io.quit = 1;
+		pthread_cond_signal(&io.cond);
+		pthread_mutex_unlock(&io.lock);
+
+		pthread_join(io.thread, NULL);
+		pthread_cond_destroy(&io.cond);
+		io.running = 0;
+	}
+	io.sent = NULL;
+
+	if (io.protocol == SERVOIO_BATCH)
+		printf("servo io: %lu batches sent to %d endpoints.\n",
+		       io.batches, io.nendpoints);
+
+	for (i = 0; i < SERVOIO_CHANNELS; i++)
+		printf("%s: %lu commands sent, %lu coalesced.\n",
+		       server[i].name, server[i].sent, server[i].coalesced);
+
+	if (sockfd >= 0)
+		close(sockfd);
+	sockfd = -1;
+}
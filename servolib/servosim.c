@@ -0,0 +1,84 @@
+/**
+ * @file servolib/servosim.c
+ * @brief Shared state of the servo simulator.
+ *
+ * The simulator is the only writer; anything else maps the state
+ * read-only and copies it out under the sequence counter.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "servosim.h"
+
+struct servosim_state *servosim_map(int create)
+{
+	struct servosim_state *s;
+	int fd, prot = PROT_READ;
+
+	if (create) {
+		fd = shm_open(SERVOSIM_SHM, O_CREAT | O_RDWR, 0644);
+		if (fd < 0)
+			return NULL;
+
+		if (ftruncate(fd, sizeof(*s))) {
+			close(fd);
+			return NULL;
+		}
+		prot |= PROT_WRITE;
+	} else {
+		fd = shm_open(SERVOSIM_SHM, O_RDONLY, 0);
+		if (fd < 0)
+			return NULL;
+	}
+
+	s = mmap(NULL, sizeof(*s), prot, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED)
+		return NULL;
+
+	if (!create && s->magic != SERVOSIM_MAGIC) {
+		munmap(s, sizeof(*s));
+		return NULL;
+	}
+
+	return s;
+}
+
+void servosim_unmap(struct servosim_state *s)
+{
+	munmap(s, sizeof(*s));
+}
+
+int servosim_read(const struct servosim_state *s, struct servosim_state *copy)
+{
+	uint32_t seq;
+	int tries;
+
+	for (tries = 0; tries < 1000; tries++) {
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		memcpy(copy, s, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+
+	return -EAGAIN;
+}
+
+void servosim_begin(struct servosim_state *s)
+{
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void servosim_end(struct servosim_state *s)
+{
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,303 @@
+/**
+ * @file servolib/servosimd.c
+ * @brief Servo simulator: stands in for the pan/tilt servos on the ports
+ * servoio sends to.
+ *
+ * Commands, ASCII or batched, take effect after a fixed latency; the
+ * servos then slew towards them at a fixed rate. The simulated positions
+ * are published in shared memory for the synthetic scene capture source.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "time_utils.h"
+#include "servosim.h"
+
+#define SIM_TICK_MS		1
+#define SIM_MAX_PENDING		256
+
+struct sim_command {
+	unsigned long long due;
+	int channel;
+	int duty;
+};
+
+static struct {
+	struct sim_command pending[SIM_MAX_PENDING];
+	unsigned int head;
+	unsigned int tail;
+	unsigned long overruns;
+	uint32_t batch_seq;
+	int have_batch;
+} sim;
+
+static volatile sig_atomic_t quit;
+
+static const struct option options[] = {
+	{
+#define help_opt	0
+		.name = "help",
+		.has_arg = 0,
+		.flag = NULL,
+	},
+	{
+#define slew_opt	1
+		.name = "slew",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define latency_opt	2
+		.name = "latency",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+		.name = NULL,
+	},
+};
+
+static
+void usage(void)
+{
+	fprintf(stderr, "usage: fll-servosim <options>, with:\n");
+	fprintf(stderr, "            --slew=<duty/s>                 "
+		":servo speed (default: 100)\n");
+	fprintf(stderr, "            --latency=<ms>                  "
+		":command to motion delay (default: 20)\n");
+	fprintf(stderr, "            --help                          "
+		"this help\n");
+}
+
+static
+void sim_stop(int sig)
+{
+	quit = 1;
+}
+
+static
+int sim_socket(int port)
+{
+	struct sockaddr_in addr;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		close(fd);
+		return -errno;
+	}
+
+	return fd;
+}
+
+static
+void sim_queue(struct servosim_state *s, int channel, int duty,
+	       unsigned long long now)
+{
+	struct sim_command *c;
+
+	if (duty > MAX_DUTY)
+		duty = MAX_DUTY;
+	if (duty < MIN_DUTY)
+		duty = MIN_DUTY;
+
+	if (sim.head - sim.tail == SIM_MAX_PENDING) {
+		sim.overruns++;
+		return;
+	}
+
+	c = &sim.pending[sim.head++ % SIM_MAX_PENDING];
+	c->due = now + s->latency_ms * FLL_NANOSECONDS_IN_MILISECOND;
+	c->channel = channel;
+	c->duty = duty;
+	s->axis[channel].commands++;
+}
+
+static
+void sim_receive(struct servosim_state *s, int fd, int channel,
+		 unsigned long long now)
+{
+	struct servoio_batch *b;
+	char buf[64];
+	ssize_t n;
+	int i;
+
+	for (;;) {
+		n = recv(fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+		if (n <= 0)
+			return;
+
+		b = (struct servoio_batch *) buf;
+		if (n == sizeof(*b) && ntohl(b->magic) == SERVOIO_BATCH_MAGIC) {
+			/* the same batch reaches every port */
+			if (sim.have_batch && ntohl(b->seq) == sim.batch_seq)
+				continue;
+			sim.batch_seq = ntohl(b->seq);
+			sim.have_batch = 1;
+
+			for (i = 0; i < b->count && i < SERVOIO_CHANNELS; i++)
+				sim_queue(s, i, b->duty[i], now);
+			continue;
+		}
+
+		buf[n] = '\0';
+		sim_queue(s, channel, atoi(buf), now);
+	}
+}
+
+/* commands whose latency expired become targets, then everybody slews */
+static
+void sim_step(struct servosim_state *s, unsigned long long now, double dt)
+{
+	struct servosim_axis *a;
+	struct sim_command *c;
+	double step;
+	int i;
+
+	servosim_begin(s);
+
+	while (sim.tail != sim.head) {
+		c = &sim.pending[sim.tail % SIM_MAX_PENDING];
+		if (c->due > now)
+			break;
+		s->axis[c->channel].target = c->duty;
+		sim.tail++;
+	}
+
+	for (i = 0; i < SERVOIO_CHANNELS; i++) {
+		a = &s->axis[i];
+		step = s->slew * dt;
+		if (a->target > a->position)
+			a->position = a->position + step < a->target ?
+				a->position + step : a->target;
+		else
+			a->position = a->position - step > a->target ?
+				a->position - step : a->target;
+	}
+	s->updated = now;
+
+	servosim_end(s);
+}
+
+int main(int argc, char *const argv[])
+{
+	static const int ports[SERVOIO_CHANNELS] = {
+		[pan_channel] = SERVOIO_PAN_PORT,
+		[tilt_channel] = SERVOIO_TILT_PORT,
+	};
+	static const int homes[SERVOIO_CHANNELS] = {
+		[pan_channel] = SERVOIO_PAN_HOME,
+		[tilt_channel] = SERVOIO_TILT_HOME,
+	};
+	struct pollfd fds[SERVOIO_CHANNELS];
+	unsigned long long now, last;
+	struct servosim_state *s;
+	double slew = 100, latency = 20;
+	int lindex, c, i;
+
+	for (;;) {
+		lindex = -1;
+		c = getopt_long_only(argc, argv, "", options, &lindex);
+		if (c == EOF)
+			break;
+		switch (lindex) {
+		case help_opt:
+			usage();
+			exit(0);
+		case slew_opt:
+			slew = atof(optarg);
+			break;
+		case latency_opt:
+			latency = atof(optarg);
+			break;
+		default:
+			usage();
+			exit(1);
+		}
+	}
+
+	if (slew <= 0 || latency < 0) {
+		usage();
+		exit(1);
+	}
+
+	for (i = 0; i < SERVOIO_CHANNELS; i++) {
+		fds[i].fd = sim_socket(ports[i]);
+		fds[i].events = POLLIN;
+		if (fds[i].fd < 0) {
+			fprintf(stderr, "error: can't listen on port %d: %s\n",
+				ports[i], strerror(-fds[i].fd));
+			exit(1);
+		}
+	}
+
+	s = servosim_map(1);
+	if (!s) {
+		fprintf(stderr, "error: can't map %s\n", SERVOSIM_SHM);
+		exit(1);
+	}
+
+	servosim_begin(s);
+	s->magic = SERVOSIM_MAGIC;
+	s->slew = slew;
+	s->latency_ms = latency;
+	for (i = 0; i < SERVOIO_CHANNELS; i++) {
+		s->axis[i].home = homes[i];
+		s->axis[i].position = s->axis[i].target = homes[i];
+		s->axis[i].commands = 0;
+	}
+	servosim_end(s);
+
+	signal(SIGINT, sim_stop);
+	signal(SIGTERM, sim_stop);
+
+	printf("servo simulator: slew %.1f duty/s, latency %.1f ms\n",
+	       slew, latency);
+
+	last = monotonic_nsecs();
+	while (!quit) {
+		poll(fds, SERVOIO_CHANNELS, SIM_TICK_MS);
+
+		now = monotonic_nsecs();
+		for (i = 0; i < SERVOIO_CHANNELS; i++) {
+			if (fds[i].revents & POLLIN)
+				sim_receive(s, fds[i].fd, i, now);
+		}
+
+		sim_step(s, now, (double) (now - last) / FLL_NANOSECONDS_IN_SECOND);
+		last = now;
+	}
+
+	for (i = 0; i < SERVOIO_CHANNELS; i++) {
+		printf("channel %d: %llu commands, at %.1f\n", i,
+		       (unsigned long long) s->axis[i].commands,
+		       s->axis[i].position);
+		close(fds[i].fd);
+	}
+	if (sim.overruns)
+		printf("%lu commands lost\n", sim.overruns);
+
+	servosim_unmap(s);
+	shm_unlink(SERVOSIM_SHM);
+
+	return 0;
+}